@@ -16,11 +16,14 @@
 #define pad_request(size)	(((size) + CHUNK_OVERHEAD + CHUNK_GRANULARITY - 1) & -CHUNK_GRANULARITY)
 #define request2size(size)	((size) < (MIN_CHUNK_SIZE - CHUNK_OVERHEAD) ? MIN_CHUNK_SIZE : pad_request(size))
 
+#define poolidx(size)		(((size) - MIN_CHUNK_SIZE) / CHUNK_GRANULARITY)
 #define smallidx(size)		((size) / CHUNK_GRANULARITY)
 #define smallsize(idx)		((idx) * CHUNK_GRANULARITY)
+#define SMALL_SHIFT			8 /* log2(SMALL_CHUNK_SIZE) */
 #define PUSE_BIT			1 /* Previous chunk is in use */
 #define CUSE_BIT			2 /* Current chunk is in use */
-#define FLAG_MASK			(PUSE_BIT | CUSE_BIT)
+#define MOVE_BIT			4 /* Current chunk may be moved, only while compacting */
+#define FLAG_MASK			(PUSE_BIT | CUSE_BIT | MOVE_BIT)
 #define chunksize(chunk)	((chunk)->size & ~FLAG_MASK)
 #define nextchunk(c)		((struct chunk*)((uint8_t*)(c) + chunksize(c)))
 
@@ -63,7 +66,7 @@ static struct binhdr* unlink_small_head(struct alloc* alloc, int idx) {
 	struct binhdr* head = (struct binhdr*)readptr(bin->next);
 	list_unlink_chunk(alloc, head);
 	if (readptr(bin->next) == bin)
-		alloc->smallmap &= ~(1 << idx);
+		alloc->smallmap &= ~(1u << idx);
 	return head;
 }
 
@@ -72,12 +75,23 @@ static void unlink_small_chunk(struct alloc* alloc, struct chunk* chunk) {
 	list_unlink_chunk(alloc, &chunk->b);
 	struct binhdr* bin = &alloc->smallbins[idx];
 	if (readptr(bin->next) == bin)
-		alloc->smallmap &= ~(1 << idx);
+		alloc->smallmap &= ~(1u << idx);
+}
+
+static FORCEINLINE int largeidx(uint32_t size) {
+	if (size < SMALL_CHUNK_SIZE)
+		return 0;
+	int bit = mostbitidx(size);
+	int idx = ((bit - SMALL_SHIFT) << LARGE_BIN_SHIFT) + ((size >> (bit - LARGE_BIN_SHIFT)) & (LARGE_BIN_STEPS - 1));
+	return idx < LARGE_BINS ? idx : LARGE_BINS - 1;
 }
 
 static void unlink_large_chunk(struct alloc* alloc, struct chunk* chunk) {
-	struct binhdr* hdr = &chunk->b;
-	list_unlink_chunk(alloc, hdr);
+	int idx = largeidx(chunksize(chunk));
+	list_unlink_chunk(alloc, &chunk->b);
+	struct binhdr* bin = &alloc->largebins[idx];
+	if (readptr(bin->next) == bin)
+		alloc->largemap &= ~(1u << idx);
 }
 
 static FORCEINLINE void unlink_chunk(struct alloc* alloc, struct chunk* chunk) {
@@ -96,15 +110,18 @@ static FORCEINLINE void list_link_chunk(struct alloc* alloc, struct binhdr* bin,
 
 static void insert_small_chunk(struct alloc* alloc, struct chunk* chunk) {
 	uint32_t idx = smallidx(chunksize(chunk));
-	alloc->smallmap |= 1 << idx;
+	alloc->smallmap |= 1u << idx;
 	struct binhdr* bin = &alloc->smallbins[idx];
 	struct binhdr* hdr = &chunk->b;
 	list_link_chunk(alloc, bin, hdr);
 }
 
 static void insert_large_chunk(struct alloc* alloc, struct chunk* chunk) {
+	uint32_t idx = largeidx(chunksize(chunk));
+	alloc->largemap |= 1u << idx;
+	struct binhdr* bin = &alloc->largebins[idx];
 	struct binhdr* hdr = &chunk->b;
-	list_link_chunk(alloc, &alloc->largebin, hdr);
+	list_link_chunk(alloc, bin, hdr);
 }
 
 static FORCEINLINE void insert_chunk(struct alloc* alloc, struct chunk* chunk) {
@@ -115,19 +132,30 @@ static FORCEINLINE void insert_chunk(struct alloc* alloc, struct chunk* chunk) {
 }
 
 static struct binhdr* large_alloc(struct alloc* alloc, uint32_t size) {
-	struct binhdr* hdr = &alloc->largebin;
+	/* Best fit within the size class of the request, chunks there may be smaller */
+	int idx = largeidx(size);
 	struct binhdr* best = NULL;
-	uint32_t bestsize = UINT32_MAX;
-	for (struct binhdr* p = readptr(hdr->next); p != hdr; p = readptr(p->next)) {
-		struct chunk* chunk = mem2chunk(p);
-		uint32_t csize = chunksize(chunk);
-		if (csize >= size && csize < bestsize) {
-			bestsize = csize;
-			best = p;
+	if (alloc->largemap & (1u << idx)) {
+		struct binhdr* hdr = &alloc->largebins[idx];
+		uint32_t bestsize = UINT32_MAX;
+		for (struct binhdr* p = readptr(hdr->next); p != hdr; p = readptr(p->next)) {
+			uint32_t csize = chunksize(mem2chunk(p));
+			if (csize >= size && csize < bestsize) {
+				bestsize = csize;
+				best = p;
+				if (csize == size)
+					break;
+			}
 		}
 	}
-	if (best == NULL)
-		return NULL;
+	/* Any chunk of the next non-empty larger class fits */
+	if (best == NULL) {
+		bitmap_t bits = idx + 1 < LARGE_BINS ? alloc->largemap >> (idx + 1) << (idx + 1) : 0;
+		if (bits == 0)
+			return NULL;
+		struct binhdr* bin = &alloc->largebins[leastbitidx(bits)];
+		best = readptr(bin->next);
+	}
 	struct chunk* chunk = mem2chunk(best);
 	unlink_large_chunk(alloc, chunk);
 	uint32_t rsize = chunksize(chunk) - size;
@@ -159,9 +187,15 @@ struct alloc* mem_new(uint32_t size, uint32_t reserved_size) {
 		writeptr(hdr->next, hdr);
 	}
 	alloc->smallmap = 0;
-	struct binhdr* hdr = &alloc->largebin;
-	writeptr(hdr->prev, hdr);
-	writeptr(hdr->next, hdr);
+	for (int i = 0; i < LARGE_BINS; i++) {
+		struct binhdr* hdr = &alloc->largebins[i];
+		writeptr(hdr->prev, hdr);
+		writeptr(hdr->next, hdr);
+	}
+	alloc->largemap = 0;
+	for (int i = 0; i < POOLS; i++)
+		alloc->pools[i] = 0;
+	alloc->pool_memory = 0;
 	writeptr(alloc->top, (struct chunk*)((uint8_t*)alloc + reserved_size));
 	check((uintptr_t)readptr(alloc->top) % MIN_CHUNK_SIZE == 0);
 	alloc->topsize = size - reserved_size;
@@ -174,6 +208,7 @@ void mem_destroy(struct alloc* alloc) {
 
 void* mem_alloc(struct alloc* alloc, int size) {
 	size = request2size(size);
+retry:
 	if (size <= SMALL_REQUEST) {
 		int idx = smallidx(size);
 		bitmap_t bits = alloc->smallmap >> idx;
@@ -226,6 +261,11 @@ void* mem_alloc(struct alloc* alloc, int size) {
 		alloc->used_memory += size;
 		return chunk2mem(chunk);
 	}
+	/* Pooled chunks may coalesce into a large enough one */
+	if (alloc->pool_memory) {
+		mem_flush_pools(alloc);
+		goto retry;
+	}
 	/* Fail */
 	return NULL;
 }
@@ -267,7 +307,7 @@ void* mem_realloc(struct alloc* alloc, void* ptr, int request_size) {
 	}
 	/* Try enlarge current chunk */
 	struct chunk* next = nextchunk(chunk);
-	if (next == readptr(alloc->top)) {
+	if (next == readptr(alloc->top) && size <= chunksize(chunk) + alloc->topsize) {
 		uint32_t totsize = chunksize(chunk) + alloc->topsize;
 		uint32_t rsize = totsize - size;
 		if (rsize < MIN_CHUNK_SIZE) {
@@ -306,7 +346,7 @@ void* mem_realloc(struct alloc* alloc, void* ptr, int request_size) {
 	void* new_ptr = mem_alloc(alloc, request_size);
 	if (new_ptr == NULL)
 		return NULL;
-	memcpy(new_ptr, ptr, request_size);
+	memcpy(new_ptr, ptr, chunksize(chunk) - CHUNK_OVERHEAD);
 	mem_dealloc(alloc, ptr);
 	return new_ptr;
 }
@@ -330,6 +370,145 @@ void mem_dealloc(struct alloc* alloc, void* ptr) {
 	free_chunk_merge_next(alloc, chunk, size, next);
 }
 
+void* mem_alloc_pooled(struct alloc* alloc, int size) {
+	uint32_t csize = request2size(size);
+	if (csize <= POOL_CHUNK_SIZE) {
+		ptr_t* pool = &alloc->pools[poolidx(csize)];
+		if (*pool) {
+			void* mem = readptr(*pool);
+			*pool = *(ptr_t*)mem;
+			alloc->pool_memory -= csize;
+			alloc->used_memory += csize;
+			return mem;
+		}
+	}
+	return mem_alloc(alloc, size);
+}
+
+void mem_dealloc_pooled(struct alloc* alloc, void* ptr) {
+	uint32_t size = chunksize(mem2chunk(ptr));
+	if (size > POOL_CHUNK_SIZE || alloc->pool_memory + size > POOL_MAX_MEMORY(alloc)) {
+		mem_dealloc(alloc, ptr);
+		return;
+	}
+	ptr_t* pool = &alloc->pools[poolidx(size)];
+	*(ptr_t*)ptr = *pool;
+	writeptr(*pool, ptr);
+	alloc->pool_memory += size;
+	alloc->used_memory -= size;
+}
+
+void mem_flush_pools(struct alloc* alloc) {
+	for (int i = 0; i < POOLS; i++) {
+		while (alloc->pools[i]) {
+			void* mem = readptr(alloc->pools[i]);
+			alloc->pools[i] = *(ptr_t*)mem;
+			uint32_t size = chunksize(mem2chunk(mem));
+			alloc->pool_memory -= size;
+			alloc->used_memory += size;
+			mem_dealloc(alloc, mem);
+		}
+	}
+}
+
+void mem_set_movable(struct alloc* alloc, void* ptr) {
+	if (ptr)
+		mem2chunk(ptr)->size |= MOVE_BIT;
+}
+
+void mem_set_pinned(struct alloc* alloc, void* ptr) {
+	if (ptr)
+		mem2chunk(ptr)->size &= ~MOVE_BIT;
+}
+
+int mem_compact_begin(struct alloc* alloc, struct compact* c, uint32_t quota) {
+	enum { cs_find, cs_window, cs_done } state = cs_find;
+	uint32_t shift = 0;
+	struct chunk* top = readptr(alloc->top);
+	c->gap_cnt = 0;
+	c->moved = 0;
+	/* The walk clears all movable marks, even past the window */
+	for (struct chunk* chunk = (struct chunk*)((uint8_t*)alloc + alloc->reserved_size); chunk != top; chunk = nextchunk(chunk)) {
+		int movable = chunk->size & MOVE_BIT;
+		chunk->size &= ~MOVE_BIT;
+		if (state == cs_done)
+			continue;
+		if (!(chunk->size & CUSE_BIT)) {
+			if (c->gap_cnt == COMPACT_MAX_GAPS) {
+				c->end = (uint8_t*)chunk;
+				state = cs_done;
+				continue;
+			}
+			if (c->gap_cnt == 0)
+				c->start = (uint8_t*)chunk;
+			shift += chunksize(chunk);
+			c->gap[c->gap_cnt] = (uint8_t*)chunk;
+			c->shift[c->gap_cnt++] = shift;
+			state = cs_window;
+		}
+		else if (state == cs_window) {
+			if (!movable) {
+				if (c->moved) {
+					c->end = (uint8_t*)chunk;
+					state = cs_done;
+				}
+				else {
+					/* Nothing to move before it, look for the next gap */
+					c->gap_cnt = 0;
+					shift = 0;
+					state = cs_find;
+				}
+			}
+			else {
+				c->moved += chunksize(chunk);
+				if (c->moved >= quota) {
+					c->end = (uint8_t*)nextchunk(chunk);
+					state = cs_done;
+				}
+			}
+		}
+	}
+	if (state == cs_window)
+		c->end = (uint8_t*)top;
+	if (c->moved == 0)
+		return 0;
+	/* The gaps are merged into one free chunk by mem_compact_end */
+	for (int i = 0; i < c->gap_cnt; i++)
+		unlink_chunk(alloc, (struct chunk*)c->gap[i]);
+	return 1;
+}
+
+void* mem_forward(const struct compact* c, void* ptr) {
+	uint8_t* p = (uint8_t*)ptr;
+	if (p < c->start || p >= c->end)
+		return ptr;
+	/* Find the last gap below p */
+	int lo = 0, hi = c->gap_cnt - 1;
+	while (lo < hi) {
+		int mid = (lo + hi + 1) / 2;
+		if (c->gap[mid] <= p)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+	return p - c->shift[lo];
+}
+
+void mem_compact_end(struct alloc* alloc, struct compact* c) {
+	uint8_t* dst = c->start;
+	for (struct chunk* chunk = (struct chunk*)c->start; (uint8_t*)chunk != c->end;) {
+		uint32_t size = chunksize(chunk);
+		struct chunk* next = nextchunk(chunk);
+		if (chunk->size & CUSE_BIT) {
+			memmove(dst, chunk, size);
+			((struct chunk*)dst)->size |= PUSE_BIT;
+			dst += size;
+		}
+		chunk = next;
+	}
+	free_chunk_merge_next(alloc, (struct chunk*)dst, c->shift[c->gap_cnt - 1], (struct chunk*)c->end);
+}
+
 #ifdef _DEBUG
 static void check_free_chunk(struct alloc* alloc, struct chunk* chunk) {
 	uint32_t size = chunksize(chunk);
@@ -353,15 +532,31 @@ void mem_check(struct alloc* alloc) {
 			free_chunk_cnt++;
 		}
 	}
-	struct binhdr* hdr = &alloc->largebin;
-	for (struct binhdr* bin = readptr(hdr->next); bin != hdr; bin = readptr(bin->next)) {
-		check_free_chunk(alloc, mem2chunk(bin));
-		free_chunk_cnt++;
+	for (int i = 0; i < LARGE_BINS; i++) {
+		struct binhdr* hdr = &alloc->largebins[i];
+		int expected = readptr(hdr->next) != hdr;
+		check(((alloc->largemap >> i) & 1) == expected);
+		for (struct binhdr* bin = readptr(hdr->next); bin != hdr; bin = readptr(bin->next)) {
+			check(largeidx(chunksize(mem2chunk(bin))) == i);
+			check_free_chunk(alloc, mem2chunk(bin));
+			free_chunk_cnt++;
+		}
+	}
+	uint32_t pool_memory = 0;
+	for (int i = 0; i < POOLS; i++) {
+		for (ptr_t p = alloc->pools[i]; p; p = *(ptr_t*)readptr(p)) {
+			struct chunk* chunk = mem2chunk(readptr(p));
+			check(chunk->size & CUSE_BIT);
+			check(poolidx(chunksize(chunk)) == i);
+			pool_memory += chunksize(chunk);
+		}
 	}
+	check(pool_memory == alloc->pool_memory);
 	/* Check all chunks */
 	int prev_inuse = 1;
 	uint32_t used_memory = alloc->reserved_size;
 	for (struct chunk* chunk = (struct chunk*)((uint8_t*)alloc + alloc->reserved_size); chunk != readptr(alloc->top); chunk = nextchunk(chunk)) {
+		check(!(chunk->size & MOVE_BIT));
 		if (chunk->size & CUSE_BIT) {
 			used_memory += chunksize(chunk);
 			struct chunk* next = nextchunk(chunk);
@@ -378,6 +573,6 @@ void mem_check(struct alloc* alloc) {
 		}
 	}
 	check(free_chunk_cnt == 0);
-	check(used_memory == alloc->used_memory);
+	check(used_memory == alloc->used_memory + alloc->pool_memory);
 }
 #endif
@@ -11,6 +11,18 @@
 #define MIN_CHUNK_SIZE		16
 #define SMALL_BINS			(SMALL_CHUNK_SIZE / CHUNK_GRANULARITY)
 #define SMALL_REQUEST		(SMALL_CHUNK_SIZE - CHUNK_OVERHEAD)
+/* Large bins split each power of two size range into LARGE_BIN_STEPS
+ * classes, starting at SMALL_CHUNK_SIZE. The last bin holds all larger chunks */
+#define LARGE_BIN_SHIFT		2
+#define LARGE_BIN_STEPS		(1 << LARGE_BIN_SHIFT)
+#define LARGE_BINS			32
+/* Pools cache freed chunks of fixed size objects from MIN_CHUNK_SIZE up to
+ * POOL_CHUNK_SIZE, one pool per size class */
+#define POOL_CHUNK_SIZE		64
+#define POOLS				((POOL_CHUNK_SIZE - MIN_CHUNK_SIZE) / CHUNK_GRANULARITY + 1)
+#define POOL_MAX_MEMORY(alloc)	((alloc)->size / 16)
+/* Most free chunks a single compaction window merges */
+#define COMPACT_MAX_GAPS	32
 
 #ifdef RELATIVE_ADDRESSING
 typedef uint32_t ptr_t;
@@ -34,16 +46,48 @@ struct alloc {
 	uint32_t reserved_size;
 	struct binhdr smallbins[SMALL_BINS];
 	bitmap_t smallmap;
-	struct binhdr largebin;
+	struct binhdr largebins[LARGE_BINS];
+	bitmap_t largemap;
 	ptr_t top;
 	uint32_t topsize;
+	/* Pooled chunks stay in use for the heap, but not in used_memory */
+	ptr_t pools[POOLS];
+	uint32_t pool_memory;
 };
 
+/* Sliding compaction window. In use chunks between start and end slide down
+ * over the free chunks (gaps) in between, shift[i] is the size of gaps up to
+ * and including gap[i] */
+struct compact {
+	uint8_t* start;
+	uint8_t* end;
+	int gap_cnt;
+	uint8_t* gap[COMPACT_MAX_GAPS];
+	uint32_t shift[COMPACT_MAX_GAPS];
+	uint32_t moved;
+};
+
+/* Free memory outside the top area */
+#define mem_holes(alloc)	((alloc)->size - (alloc)->used_memory - (alloc)->pool_memory - (alloc)->topsize)
+
 struct alloc* mem_new(uint32_t size, uint32_t reserved_size);
 void mem_destroy(struct alloc* alloc);
 void* mem_alloc(struct alloc* alloc, int size);
 void* mem_realloc(struct alloc* alloc, void* ptr, int size);
 void mem_dealloc(struct alloc* alloc, void* ptr);
+/* Allocate or free through the size class pools, for fixed size objects */
+void* mem_alloc_pooled(struct alloc* alloc, int size);
+void mem_dealloc_pooled(struct alloc* alloc, void* ptr);
+/* Return all pooled chunks to the heap */
+void mem_flush_pools(struct alloc* alloc);
+/* Compaction: mark every chunk whose references can be updated as movable,
+ * pick a window moving about quota bytes, forward all references, then move.
+ * Chunks not marked movable pin the window end */
+void mem_set_movable(struct alloc* alloc, void* ptr);
+void mem_set_pinned(struct alloc* alloc, void* ptr);
+int mem_compact_begin(struct alloc* alloc, struct compact* c, uint32_t quota);
+void* mem_forward(const struct compact* c, void* ptr);
+void mem_compact_end(struct alloc* alloc, struct compact* c);
 #ifdef _DEBUG
 /* Check allocator integrity */
 void mem_check(struct alloc* alloc);
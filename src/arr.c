@@ -11,7 +11,7 @@ struct arrobj* arr_new(struct cpu* cpu) {
 
 void arr_destroy(struct cpu* cpu, struct arrobj* arr) {
 	mem_dealloc(&cpu->alloc, readptr_nullable(arr->data));
-	mem_dealloc(&cpu->alloc, arr);
+	mem_dealloc_pooled(&cpu->alloc, arr);
 }
 
 value_t arr_get(struct cpu* cpu, struct arrobj* arr, number index) {
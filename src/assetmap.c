@@ -22,7 +22,7 @@ struct assetmapobj* assetmap_new_copydata(struct cpu* cpu, int w, int h, const u
 }
 
 void assetmap_destroy(struct cpu* cpu, struct assetmapobj* assetmap) {
-	mem_dealloc(&cpu->alloc, assetmap);
+	mem_dealloc_pooled(&cpu->alloc, assetmap);
 }
 
 value_t libassetmap_draw(struct cpu* cpu, int sp, int nargs) {
@@ -39,7 +39,7 @@ struct bufobj* buf_new_overlayvmem(struct cpu* cpu) {
 }
 
 void buf_destroy(struct cpu* cpu, struct bufobj* buf) {
-	mem_dealloc(&cpu->alloc, buf);
+	mem_dealloc_pooled(&cpu->alloc, buf);
 }
 
 static FORCEINLINE void buf_getdata(struct cpu* cpu, struct bufobj* buf, uint8_t** data, uint32_t* len) {
@@ -30,6 +30,8 @@ typedef value_t(*cfunc)(struct cpu* cpu, int sp, int nargs);
 	X(lib_rand) \
 	X(lib_statCpu) \
 	X(lib_statMem) \
+	X(lib_gcTune) \
+	X(lib_strbuf) \
 	X(devlib_key) \
 	X(devlib_keyp) \
 	X(devlib_mpos) \
@@ -54,6 +56,9 @@ typedef value_t(*cfunc)(struct cpu* cpu, int sp, int nargs);
 	X(libstr_indexOf) \
 	X(libstr_lastIndexOf) \
 	X(libstr_substr) \
+	X(libstrbuf_append) \
+	X(libstrbuf_clear) \
+	X(libstrbuf_toString) \
 	X(libassetmap_draw) \
 	X(libassetmap_get) \
 	X(libassetmap_set)
@@ -2,8 +2,12 @@
 #include "arith.h"
 #include "compiler.h"
 #include "config.h"
+#include "opt.h"
+#include "platform.h"
+#include "rand.h"
 #include "str.h"
 #include "sym.h"
+#include "tab.h"
 
 #include <setjmp.h>
 #include <stdarg.h>
@@ -20,6 +24,7 @@
 	X(tk_case, "case", _, _, _, _, _) \
 	X(tk_continue, "continue", _, _, _, _, _) \
 	X(tk_default, "default", _, _, _, _, _) \
+	X(tk_delete, "delete", _, _, _, _, _) \
 	X(tk_do, "do", _, _, _, _, _) \
 	X(tk_else, "else", _, _, _, _, _) \
 	X(tk_false, "false", _, _, _, _, _) \
@@ -147,6 +152,9 @@ struct functx {
 	struct functx* enfunc;
 	int code_id;
 	int sym_level;
+	/* constants by value while compiling, slots hold the index + 1 */
+	int khash_cap;
+	int* khash;
 };
 
 enum patch_type {
@@ -182,6 +190,7 @@ struct context {
 	struct sym_table sym_table;
 	struct functx* topfunc;
 	int canbreak, cancontinue;
+	int label_pc;
 	int patch_cnt, patch_cap;
 	struct patch* patch;
 };
@@ -582,20 +591,44 @@ static struct ins* add_ins(struct context* ctx) {
 	return &ins[ins_id];
 }
 
+static void khash_grow(struct context* ctx, struct functx* func, struct code* code) {
+	struct cpu* cpu = ctx->cpu;
+	int cap = func->khash_cap == 0 ? 16 : func->khash_cap * 2;
+	int* khash = (int*)mem_alloc(ctx->alloc, cap * sizeof(int));
+	memset(khash, 0, cap * sizeof(int));
+	uint32_t* k = readptr_nullable(code->k);
+	for (int i = 0; i < code->k_cnt; i++) {
+		uint32_t h = fmix32(k[i]) & (cap - 1);
+		while (khash[h])
+			h = (h + 1) & (cap - 1);
+		khash[h] = i + 1;
+	}
+	mem_dealloc(ctx->alloc, func->khash);
+	func->khash = khash;
+	func->khash_cap = cap;
+}
+
 static int add_const(struct context* ctx, uint32_t val) {
 	/* find duplicate constant */
 	struct cpu* cpu = ctx->cpu;
 	struct code* code = topcode();
+	struct functx* func = ctx->topfunc;
+	if (code->k_cnt * 2 >= func->khash_cap)
+		khash_grow(ctx, func, code);
 	uint32_t* k = readptr_nullable(code->k);
-	for (int i = 0; i < code->k_cnt; i++)
-		if (k[i] == val)
-			return i;
+	uint32_t h = fmix32(val) & (func->khash_cap - 1);
+	while (func->khash[h]) {
+		if (k[func->khash[h] - 1] == val)
+			return func->khash[h] - 1;
+		h = (h + 1) & (func->khash_cap - 1);
+	}
 	if (code->k_cnt - 1 == MAX_K)
 		compile_error(ctx, "Too many constants in this function.");
 	vec_add(ctx->alloc, k, code->k_cnt, code->k_cap);
 	code->k = writeptr(k);
 	uint32_t* kval = &k[code->k_cnt - 1];
 	*kval = val;
+	func->khash[h] = code->k_cnt;
 	return code->k_cnt - 1;
 }
 
@@ -651,6 +684,9 @@ static inline int current_pc(struct context* ctx) {
 static inline void patch_rel(struct context* ctx, int pc, int target) {
 	struct cpu* cpu = ctx->cpu;
 	((struct ins*)readptr(topcode()->ins))[pc].imm = target - pc - 1;
+	/* remember jump targets at the end of code, they prevent fusing */
+	if (target == topcode()->ins_cnt)
+		ctx->label_pc = target;
 }
 
 enum value_type {
@@ -661,8 +697,7 @@ enum value_type {
 	vt_str, /* string constant */
 	vt_value, /* generic in-reg value */
 	vt_local, /* local variable */
-	vt_global, /* global variable */
-	vt_globals, /* global variable with constant string identifier */
+	vt_global, /* global variable slot */
 	vt_upval, /* upvalue */
 	vt_member, /* object member */
 	vt_membern, /* object constant number member */
@@ -675,6 +710,7 @@ struct sval {
 		int b;
 		number num;
 		uint32_t ptr;
+		uint16_t slot;
 		struct {
 			uint8_t reg;
 			uint8_t field;
@@ -733,17 +769,10 @@ static inline struct sval sval_local(uint8_t reg) {
 	return val;
 }
 
-static inline struct sval sval_global(uint8_t reg) {
+static inline struct sval sval_global(uint16_t slot) {
 	struct sval val;
 	val.type = vt_global;
-	val.reg = reg;
-	return val;
-}
-
-static inline struct sval sval_globals(uint8_t k) {
-	struct sval val;
-	val.type = vt_globals;
-	val.reg = k;
+	val.slot = slot;
 	return val;
 }
 
@@ -925,7 +954,6 @@ static void sval_pop(struct context* ctx, struct sval sval) {
 
 	case vt_value:
 	case vt_local:
-	case vt_global:
 	case vt_membern:
 	case vt_members:
 		sval_popone(ctx, sval.reg);
@@ -972,11 +1000,7 @@ static struct sval sval_get(struct context* ctx, struct sval sval) {
 	case vt_local:
 		return sval;
 	case vt_global: {
-		emit(ctx, op_gget, ctx->sp, sval.reg, 0);
-		return sval_value(ctx->sp++);
-	}
-	case vt_globals: {
-		emit(ctx, op_ggets, ctx->sp, sval.reg, 0);
+		emit_imm(ctx, op_gget, ctx->sp, sval.slot);
 		return sval_value(ctx->sp++);
 	}
 	case vt_upval: {
@@ -1026,10 +1050,7 @@ static void sval_set(struct context* ctx, struct sval lval, struct sval rval) {
 			emit(ctx, op_mov, lval.reg, rval.reg, 0);
 		break;
 	case vt_global:
-		emit(ctx, op_gset, lval.reg, rval.reg, 0);
-		break;
-	case vt_globals:
-		emit(ctx, op_gsets, lval.reg, rval.reg, 0);
+		emit_imm(ctx, op_gset, rval.reg, lval.slot);
 		break;
 	case vt_upval:
 		emit(ctx, op_uset, lval.reg, rval.reg, 0);
@@ -1051,6 +1072,14 @@ static struct strobj* tkstr(struct context* ctx) {
 	return str_intern_nogc(ctx->cpu, ctx->token_str_begin, (int)(ctx->token_str_end - ctx->token_str_begin));
 }
 
+static int global_slot(struct context* ctx, struct strobj* name) {
+	struct cpu* cpu = ctx->cpu;
+	int slot = tab_reserve(cpu, (struct tabobj*)readptr(cpu->globals), name);
+	if (slot == -1)
+		compile_error(ctx, "Too many globals.");
+	return slot;
+}
+
 static void add_patch(struct context* ctx, enum patch_type type, int pc) {
 	vec_add(ctx->alloc, ctx->patch, ctx->patch_cnt, ctx->patch_cap);
 	struct patch* patch = &ctx->patch[ctx->patch_cnt - 1];
@@ -1068,6 +1097,8 @@ static int add_code(struct cpu* cpu) {
 	code->ins_cnt = 0;
 	code->ins_cap = 0;
 	code->ins = writeptr_nullable(NULL);
+	code->icache = writeptr_nullable(NULL);
+	code->blkcost = writeptr_nullable(NULL);
 	code->lineinfo_cnt = 0;
 	code->lineinfo_cap = 0;
 	code->lineinfo = writeptr_nullable(NULL);
@@ -1080,12 +1111,80 @@ static int add_code(struct cpu* cpu) {
 	return cpu->code_cnt - 1;
 }
 
+/* 0: falls through, 1: ends a basic block, 2: ends a basic block and
+ * is followed by a jump offset word */
+static int block_end(uint8_t opcode) {
+	switch (opcode) {
+	case op_j: case op_closej: case op_jtrue: case op_jfalse:
+	case op_call: case op_ret: case op_retu:
+		return 1;
+	case op_jlt: case op_jltrn: case op_jltnr:
+	case op_jge: case op_jgern: case op_jgenr:
+	case op_jeq: case op_jeqrn: case op_jne: case op_jnern:
+		return 2;
+	default:
+		return 0;
+	}
+}
+
+static void finish_code_impl(struct cpu* cpu, struct code* code) {
+	/* allocate inline caches now that the instruction count is final */
+	uint16_t* icache = (uint16_t*)mem_alloc(&cpu->alloc, code->ins_cnt * sizeof(uint16_t));
+	memset(icache, 0, code->ins_cnt * sizeof(uint16_t));
+	code->icache = writeptr(icache);
+	/* block costs are charged when entering a block, mark block ends
+	 * first, then count instructions backwards from each of them */
+	struct ins* ins = (struct ins*)readptr(code->ins);
+	uint16_t* blkcost = (uint16_t*)mem_alloc(&cpu->alloc, code->ins_cnt * sizeof(uint16_t));
+	for (int i = 0; i < code->ins_cnt; i++) {
+		int end = block_end(ins[i].opcode);
+		blkcost[i] = end ? 1 : 0;
+		if (end == 2 && i + 1 < code->ins_cnt)
+			blkcost[++i] = 0xFFFF;
+	}
+	uint16_t cost = 0;
+	for (int i = code->ins_cnt - 1; i >= 0; i--) {
+		if (blkcost[i] == 0xFFFF)
+			blkcost[i] = 0;
+		else if (blkcost[i])
+			cost = 1;
+		else
+			blkcost[i] = cost < 0xFFFF ? ++cost : cost;
+	}
+	code->blkcost = writeptr(blkcost);
+}
+
+static void finish_code(struct context* ctx) {
+	struct cpu* cpu = ctx->cpu;
+	mem_dealloc(ctx->alloc, ctx->topfunc->khash);
+	ctx->topfunc->khash = NULL;
+	ctx->topfunc->khash_cap = 0;
+	opt_code(cpu, ctx->topfunc->code_id);
+	finish_code_impl(cpu, topcode());
+}
+
 #define compile_single_expression	compile_assign
 static struct sval compile_assign(struct context* ctx);
 static struct sval compile_expression(struct context* ctx);
 static void compile_statement(struct context* ctx);
 static void compile_block(struct context* ctx);
 
+static void push_scope(struct context* ctx) {
+	if (!sym_push(&ctx->sym_table))
+		compile_error(ctx, "Too many symbols.");
+}
+
+/* Declares the identifier token in the innermost scope, returns NULL if it
+ * is declared there already */
+static struct sym* declare_sym(struct context* ctx) {
+	struct sym* sym;
+	int ret = sym_emplace(&ctx->sym_table, ctx->sym_table.level,
+		ctx->token_str_begin, ctx->token_str_end - ctx->token_str_begin, &sym);
+	if (ret < 0)
+		compile_error(ctx, "Too many symbols.");
+	return ret ? sym : NULL;
+}
+
 static int add_updef(struct context* ctx, struct functx* fctx, int level, int reg) {
 	int in_stack, idx;
 	if (level >= fctx->enfunc->sym_level) {
@@ -1117,7 +1216,7 @@ static int add_updef(struct context* ctx, struct functx* fctx, int level, int re
 static struct sval compile_function(struct context* ctx, int global) {
 	struct cpu* cpu = ctx->cpu;
 	next_token(ctx);
-	sym_push(&ctx->sym_table);
+	push_scope(ctx);
 	struct strobj* name = NULL;
 	if (global) {
 		if (ctx->topfunc->enfunc != NULL) // TODO: Wrong hoisting semantics
@@ -1128,9 +1227,8 @@ static struct sval compile_function(struct context* ctx, int global) {
 	}
 	else if (ctx->token == tk_ident) {
 		/* named function */
-		struct sym* sym;
-		if (!sym_emplace(&ctx->sym_table, ctx->sym_table.level,
-			ctx->token_str_begin, ctx->token_str_end - ctx->token_str_begin, &sym))
+		struct sym* sym = declare_sym(ctx);
+		if (!sym)
 			internal_error(ctx);
 		name = tkstr(ctx);
 		sym->reg = 0;
@@ -1143,11 +1241,9 @@ static struct sval compile_function(struct context* ctx, int global) {
 			if (nargs)
 				require_token(ctx, tk_comma);
 			check_token(ctx, tk_ident);
-			struct sym* sym;
-			if (!sym_emplace(&ctx->sym_table, ctx->sym_table.level,
-				ctx->token_str_begin, ctx->token_str_end - ctx->token_str_begin, &sym)) {
+			struct sym* sym = declare_sym(ctx);
+			if (!sym)
 				compile_error(ctx, "Parameter redefinition.");
-			}
 			sym->reg = 1 + ++nargs;
 			next_token(ctx);
 		} while (ctx->token == tk_comma);
@@ -1162,6 +1258,8 @@ static struct sval compile_function(struct context* ctx, int global) {
 	code->enclosure = ctx->topfunc->code_id;
 	code->name = writeptr_nullable(name);
 	func.sym_level = ctx->sym_table.level;
+	func.khash_cap = 0;
+	func.khash = NULL;
 	ctx->topfunc = &func;
 	int old_sp = ctx->sp;
 	int old_local_sp = ctx->local_sp;
@@ -1174,6 +1272,7 @@ static struct sval compile_function(struct context* ctx, int global) {
 	compile_block(ctx);
 	require_token(ctx, tk_rbrace);
 	emit(ctx, op_retu, 0, 0, 0);
+	finish_code(ctx);
 	ctx->sp = old_sp;
 	ctx->local_sp = old_local_sp;
 	ctx->lastlinenum = old_lastlinenum;
@@ -1181,16 +1280,8 @@ static struct sval compile_function(struct context* ctx, int global) {
 	ctx->topfunc = func.enfunc;
 	sym_pop(&ctx->sym_table);
 	if (global) {
-		int slot = add_const(ctx, forcewriteptr(name));
-		if (slot <= MAX_KOP) {
-			emit_imm(ctx, op_func, ctx->sp, func.code_id);
-			emit(ctx, op_gsets, slot, ctx->sp, 0);
-		}
-		else {
-			emit_imm(ctx, op_kstr, ctx->sp, slot);
-			emit_imm(ctx, op_func, ctx->sp + 1, func.code_id);
-			emit(ctx, op_gset, ctx->sp, ctx->sp + 1, 0);
-		}
+		emit_imm(ctx, op_func, ctx->sp, func.code_id);
+		emit_imm(ctx, op_gset, ctx->sp, global_slot(ctx, name));
 	}
 	else
 		emit_imm(ctx, op_func, ctx->sp, func.code_id);
@@ -1208,18 +1299,12 @@ static struct sval compile_element(struct context* ctx) {
 			next_token(ctx);
 			if (level >= ctx->topfunc->sym_level)
 				return sval_local(sym->reg);
-			sym->upval_used = 1;
+			sym_capture(&ctx->sym_table, sym);
 			return sval_upval(add_updef(ctx, ctx->topfunc, level, sym->reg));
 		}
 		struct strobj* key = tkstr(ctx);
 		next_token(ctx);
-		int slot = add_const(ctx, forcewriteptr(key));
-		if (slot <= MAX_KOP)
-			return sval_globals(slot);
-		else {
-			emit_imm(ctx, op_kstr, ctx->sp, slot);
-			return sval_global(ctx->sp++);
-		}
+		return sval_global(global_slot(ctx, key));
 	}
 	case tk_num: {
 		next_token(ctx);
@@ -1256,13 +1341,7 @@ static struct sval compile_element(struct context* ctx) {
 		next_token(ctx);
 		if (ctx->topfunc->enfunc == NULL) {
 			// TODO: Is this semantic correct when global is re-assigned?
-			int slot = add_const(ctx, forcewriteptr(LIT(global)));
-			if (slot <= MAX_KOP)
-				emit(ctx, op_ggets, ctx->sp, slot, 0);
-			else {
-				emit_imm(ctx, op_kstr, ctx->sp, slot);
-				emit(ctx, op_gget, ctx->sp, ctx->sp, 0);
-			}
+			emit_imm(ctx, op_gget, ctx->sp, global_slot(ctx, LIT(global)));
 			return sval_value(ctx->sp++);
 		}
 		else
@@ -1438,6 +1517,27 @@ static struct sval compile_unary(struct context* ctx) {
 		emit(ctx, op, ctx->sp, val.reg, 0);
 		return sval_value(ctx->sp++);
 	}
+	else if (ctx->token == tk_delete) {
+		next_token(ctx);
+		struct sval val = compile_postfix(ctx);
+		switch (val.type) {
+		case vt_member:
+			sval_pop(ctx, val);
+			emit(ctx, op_fdel, ctx->sp, val.reg, val.field);
+			break;
+		case vt_membern:
+		case vt_members: {
+			int k = ctx->sp++;
+			emit_imm(ctx, val.type == vt_membern ? op_knum : op_kstr, k, val.field);
+			sval_popone(ctx, k);
+			sval_pop(ctx, val);
+			emit(ctx, op_fdel, ctx->sp, val.reg, k);
+			break;
+		}
+		default: compile_error(ctx, "Deleting non-member.");
+		}
+		return sval_value(ctx->sp++);
+	}
 	else if (ctx->token == tk_inc || ctx->token == tk_dec) {
 		enum opcode op = token_ops[ctx->token];
 		next_token(ctx);
@@ -1526,14 +1626,59 @@ static struct sval compile_binary(struct context* ctx) {
 	return lval;
 }
 
+static int fuse_condjump(struct ins* ins, int on_true) {
+	/* rewrite comparison into compare and branch, a <= b is b >= a etc. */
+	enum opcode op;
+	int swap = 0;
+	switch (ins->opcode) {
+	case op_lt: op = on_true ? op_jlt : op_jge; break;
+	case op_ltrn: op = on_true ? op_jltrn : op_jgern; break;
+	case op_ltnr: op = on_true ? op_jltnr : op_jgenr; break;
+	case op_le: op = on_true ? op_jge : op_jlt; swap = 1; break;
+	case op_lern: op = on_true ? op_jgenr : op_jltnr; swap = 1; break;
+	case op_lenr: op = on_true ? op_jgern : op_jltrn; swap = 1; break;
+	case op_gt: op = on_true ? op_jlt : op_jge; swap = 1; break;
+	case op_gtrn: op = on_true ? op_jltnr : op_jgenr; swap = 1; break;
+	case op_gtnr: op = on_true ? op_jltrn : op_jgern; swap = 1; break;
+	case op_ge: op = on_true ? op_jge : op_jlt; break;
+	case op_gern: op = on_true ? op_jgern : op_jltrn; break;
+	case op_genr: op = on_true ? op_jgenr : op_jltnr; break;
+	case op_eq: op = on_true ? op_jeq : op_jne; break;
+	case op_eqrn: op = on_true ? op_jeqrn : op_jnern; break;
+	case op_eqnr: op = on_true ? op_jeqrn : op_jnern; swap = 1; break;
+	case op_ne: op = on_true ? op_jne : op_jeq; break;
+	case op_nern: op = on_true ? op_jnern : op_jeqrn; break;
+	case op_nenr: op = on_true ? op_jnern : op_jeqrn; swap = 1; break;
+	default: return 0;
+	}
+	ins->opcode = op;
+	ins->op1 = swap ? ins->op3 : ins->op2;
+	ins->op2 = swap ? ins->op2 : ins->op3;
+	return 1;
+}
+
+/* Emit a jump taken when val is true (or false), returns the pc to patch */
+static int compile_condjump(struct context* ctx, struct sval val, int on_true) {
+	struct cpu* cpu = ctx->cpu;
+	val = sval_extract(ctx, val);
+	sval_pop(ctx, val);
+	int pc = current_pc(ctx);
+	if (val.type == vt_value && pc > 0 && ctx->label_pc != pc) {
+		struct ins* ins = &((struct ins*)readptr(topcode()->ins))[pc - 1];
+		if (ins->op1 == val.reg && fuse_condjump(ins, on_true)) {
+			emit_imm(ctx, op_j, 0, 0);
+			return pc;
+		}
+	}
+	emit_imm(ctx, on_true ? op_jtrue : op_jfalse, val.reg, 0);
+	return pc;
+}
+
 static struct sval compile_ternary(struct context* ctx) {
 	struct sval val = compile_binary(ctx);
 	if (ctx->token == tk_qmark) {
 		next_token(ctx);
-		val = sval_extract(ctx, val);
-		sval_pop(ctx, val);
-		int pc = current_pc(ctx);
-		emit_imm(ctx, op_jfalse, val.reg, 0);
+		int pc = compile_condjump(ctx, val, 0);
 		struct sval true_val = compile_ternary(ctx);
 		true_val = sval_force_extract(ctx, true_val);
 		sval_pop(ctx, true_val);
@@ -1632,11 +1777,9 @@ static void compile_let(struct context* ctx, struct sval* single_sval) {
 	do {
 		next_token(ctx);
 		check_token(ctx, tk_ident);
-		struct sym* sym;
-		if (!sym_emplace(&ctx->sym_table, ctx->sym_table.level,
-			ctx->token_str_begin, ctx->token_str_end - ctx->token_str_begin, &sym)) {
+		struct sym* sym = declare_sym(ctx);
+		if (!sym)
 			compile_error(ctx, "Identifier redefinition.");
-		}
 		sym->reg = ctx->sp;
 		++ctx->sp;
 		++ctx->local_sp;
@@ -1707,10 +1850,7 @@ static void compile_statement(struct context* ctx) {
 		require_token(ctx, tk_lparen);
 		struct sval val = compile_expression(ctx);
 		require_token(ctx, tk_rparen);
-		val = sval_extract(ctx, val);
-		sval_pop(ctx, val);
-		int pc = current_pc(ctx);
-		emit_imm(ctx, op_jfalse, val.reg, 0);
+		int pc = compile_condjump(ctx, val, 0);
 		compile_statement(ctx);
 		if (ctx->token == tk_else) {
 			next_token(ctx);
@@ -1744,9 +1884,9 @@ static void compile_statement(struct context* ctx) {
 			struct sval cval = compile_expression(ctx);
 			cval = sval_extract(ctx, cval);
 			require_token(ctx, tk_colon);
-			emit(ctx, op_eq, ctx->sp, val.reg, cval.reg);
+			emit(ctx, op_jne, val.reg, cval.reg, 0);
 			cond_pc = current_pc(ctx);
-			emit_imm(ctx, op_jfalse, ctx->sp, 0);
+			emit_imm(ctx, op_j, 0, 0);
 			sval_pop(ctx, cval);
 			sval_pop(ctx, val);
 			if (passthrough_pc != -1)
@@ -1781,7 +1921,7 @@ static void compile_statement(struct context* ctx) {
 		ctx->cancontinue = 1;
 		next_token(ctx);
 		require_token(ctx, tk_lparen);
-		sym_push(&ctx->sym_table);
+		push_scope(ctx);
 		struct sval for_val = sval_undef();
 		if (ctx->token == tk_let)
 			compile_let(ctx, &for_val);
@@ -1800,10 +1940,7 @@ static void compile_statement(struct context* ctx) {
 				cond_pc = current_pc(ctx);
 				struct sval cond = compile_expression(ctx);
 				require_token(ctx, tk_semicolon);
-				cond = sval_extract(ctx, cond);
-				sval_pop(ctx, cond);
-				cond_false_pc = current_pc(ctx);
-				emit_imm(ctx, op_jfalse, cond.reg, 0);
+				cond_false_pc = compile_condjump(ctx, cond, 0);
 			}
 			int update_pc = -1;
 			if (ctx->token != tk_rparen) {
@@ -1831,16 +1968,19 @@ static void compile_statement(struct context* ctx) {
 			if (cond_false_pc != -1)
 				patch_rel(ctx, cond_false_pc, current_pc(ctx));
 		}
-		else if (ctx->token == tk_of && for_val.type != vt_undef) {
-			// for...of loop
+		else if ((ctx->token == tk_of || ctx->token == tk_in) && for_val.type != vt_undef) {
+			// for...of and for...in loop
+			int keys = ctx->token == tk_in;
 			next_token(ctx);
 			struct sval iterable = compile_expression(ctx);
 			iterable = sval_extract(ctx, iterable);
 			sval_pop(ctx, iterable);
-			int iterable_reg = ctx->sp++;
-			emit(ctx, op_iter, iterable_reg, iterable.reg, 0);
+			/* iterated object and cursor */
+			int iterable_reg = ctx->sp;
+			ctx->sp += 2;
+			emit(ctx, op_iter, iterable_reg, iterable.reg, keys);
 			int done = ctx->sp++;
-			ctx->local_sp += 2;
+			ctx->local_sp += 3;
 			continue_pc = current_pc(ctx);
 			if (for_val.type == vt_local)
 				emit(ctx, op_next, done, for_val.reg, iterable_reg);
@@ -1880,10 +2020,7 @@ static void compile_statement(struct context* ctx) {
 		require_token(ctx, tk_lparen);
 		int loop_pc = current_pc(ctx);
 		struct sval val = compile_expression(ctx);
-		val = sval_extract(ctx, val);
-		sval_pop(ctx, val);
-		int cond_pc = current_pc(ctx);
-		emit_imm(ctx, op_jfalse, val.reg, 0);
+		int cond_pc = compile_condjump(ctx, val, 0);
 		require_token(ctx, tk_rparen);
 		compile_statement(ctx);
 		emit_rel(ctx, op_j, 0, loop_pc);
@@ -1907,9 +2044,7 @@ static void compile_statement(struct context* ctx) {
 		require_token(ctx, tk_lparen);
 		int cond_pc = current_pc(ctx);
 		struct sval val = compile_expression(ctx);
-		val = sval_extract(ctx, val);
-		sval_pop(ctx, val);
-		emit_rel(ctx, op_jtrue, val.reg, loop_pc);
+		patch_rel(ctx, compile_condjump(ctx, val, 1), loop_pc);
 		require_token(ctx, tk_rparen);
 		ctx->canbreak = old_canbreak;
 		ctx->cancontinue = old_cancontinue;
@@ -1968,7 +2103,7 @@ static void compile_statement(struct context* ctx) {
 
 static void compile_block(struct context* ctx) {
 	int old_sp = ctx->sp;
-	sym_push(&ctx->sym_table);
+	push_scope(ctx);
 	while (ctx->token != tk_eof && ctx->token != tk_rbrace)
 		compile_statement(ctx);
 	if (sym_level_needclose(&ctx->sym_table))
@@ -1978,6 +2113,12 @@ static void compile_block(struct context* ctx) {
 	ctx->local_sp = old_sp;
 }
 
+static void set_topfunc(struct cpu* cpu, int code_id) {
+	struct funcobj* topfunc = (struct funcobj*)mem_alloc(&cpu->alloc, sizeof(struct funcobj));
+	topfunc->code = writeptr(&((struct code*)readptr(cpu->code))[code_id]);
+	cpu->topfunc = writeptr(topfunc);
+}
+
 struct compile_err compile(struct cpu* cpu, const char* code, int codelen) {
 	struct context ctx;
 	ctx.err.msg = NULL;
@@ -2001,9 +2142,12 @@ struct compile_err compile(struct cpu* cpu, const char* code, int codelen) {
 	func.enfunc = NULL;
 	func.sym_level = 0;
 	func.code_id = add_code(cpu);
+	func.khash_cap = 0;
+	func.khash = NULL;
 	ctx.topfunc = &func;
 	ctx.canbreak = 0;
 	ctx.cancontinue = 0;
+	ctx.label_pc = -1;
 	ctx.patch = NULL;
 	ctx.patch_cnt = 0;
 	ctx.patch_cap = 0;
@@ -2014,11 +2158,279 @@ struct compile_err compile(struct cpu* cpu, const char* code, int codelen) {
 		if (ctx.token != tk_eof)
 			compile_error(&ctx, "Unexpected token.");
 		emit(&ctx, op_retu, 0, 0, 0);
-		struct funcobj* topfunc = (struct funcobj*)mem_alloc(&cpu->alloc, sizeof(struct funcobj));
-		topfunc->code = writeptr(&((struct code*)readptr(cpu->code))[func.code_id]);
-		cpu->topfunc = writeptr(topfunc);
+		finish_code(&ctx);
+		set_topfunc(cpu, func.code_id);
 		mem_dealloc(ctx.alloc, ctx.sbuf);
 	}
 
 	return ctx.err;
 }
+
+/* Code cache
+ * The compiled code of a source is written out and loaded into later cpus
+ * instead of compiling again. Instructions, line info and upvalue
+ * definitions are copied as they are, string constants and function names
+ * are stored as text and interned again. Global slots are compiled into
+ * the instructions, so the global names are stored in slot order and have
+ * to get the same slots back, anything else rejects the cache.
+ * The file keeps a copy of the source, which has to match, and ends in a
+ * checksum of everything before it. Loaded code is checked the same as
+ * any other input, a broken file only falls back to compiling.
+ */
+#define CODE_CACHE_MAGIC	0x62786F63u	/* "coxb" in the file */
+#define CODE_CACHE_NULL		0xFFFFFFFF
+/* FNV-1a */
+#define CODE_CACHE_SUM_SEED	2166136261u
+#define CODE_CACHE_SUM_MUL	16777619u
+
+struct code_cache_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t hash;
+	int32_t codelen;
+	int32_t code_cnt;
+	int32_t global_cnt;
+};
+
+struct code_cache {
+	void* f;
+	uint32_t sum;
+};
+
+static void cache_sum(struct code_cache* cc, const void* data, int len) {
+	const uint8_t* p = (const uint8_t*)data;
+	for (int i = 0; i < len; i++)
+		cc->sum = (cc->sum ^ p[i]) * CODE_CACHE_SUM_MUL;
+}
+
+static int cache_write(struct code_cache* cc, const void* data, int len) {
+	cache_sum(cc, data, len);
+	if (cc->f == NULL)
+		return 1;
+	return platform_write(cc->f, (const char*)data, len) == len;
+}
+
+static int cache_write_int(struct code_cache* cc, uint32_t x) {
+	return cache_write(cc, &x, 4);
+}
+
+static int cache_write_str(struct code_cache* cc, struct strobj* str) {
+	if (str == NULL)
+		return cache_write_int(cc, CODE_CACHE_NULL);
+	return cache_write_int(cc, str->len) && cache_write(cc, str->data, str->len);
+}
+
+static int cache_read(struct code_cache* cc, void* data, int len) {
+	if (platform_read(cc->f, (char*)data, len) != len)
+		return 0;
+	cache_sum(cc, data, len);
+	return 1;
+}
+
+static int cache_read_int(struct code_cache* cc, uint32_t* x) {
+	return cache_read(cc, x, 4);
+}
+
+/* Reads an array of cnt elements, which has to fit in the memory */
+static void* cache_read_vec(struct cpu* cpu, struct code_cache* cc, uint32_t cnt, int elem_size) {
+	if (cnt == 0)
+		return NULL;
+	if (cnt > CPU_MEM_SIZE / elem_size)
+		return NULL;
+	void* data = mem_alloc(&cpu->alloc, cnt * elem_size);
+	if (data == NULL)
+		return NULL;
+	if (!cache_read(cc, data, cnt * elem_size))
+		return NULL;
+	return data;
+}
+
+static int cache_read_str(struct cpu* cpu, struct code_cache* cc, struct strobj** str) {
+	uint32_t len;
+	if (!cache_read_int(cc, &len))
+		return 0;
+	if (len == CODE_CACHE_NULL) {
+		*str = NULL;
+		return 1;
+	}
+	char* buf = (char*)cache_read_vec(cpu, cc, len, 1);
+	if (len && buf == NULL)
+		return 0;
+	*str = str_intern_nogc(cpu, buf, len);
+	mem_dealloc(&cpu->alloc, buf);
+	return 1;
+}
+
+/* Compares the stored copy of the source */
+static int cache_read_src(struct code_cache* cc, const char* src, int srclen) {
+	char buf[256];
+	for (int pos = 0; pos < srclen; pos += sizeof(buf)) {
+		int len = srclen - pos < (int)sizeof(buf) ? srclen - pos : (int)sizeof(buf);
+		if (!cache_read(cc, buf, len) || memcmp(buf, src + pos, len) != 0)
+			return 0;
+	}
+	return 1;
+}
+
+/* Upvalues come from the frame or from the enclosing function, not from the
+ * function and call info slots of the frame */
+static int cache_check_upvals(struct cpu* cpu, struct code* code) {
+	struct updef* defs = (struct updef*)readptr_nullable(code->upval);
+	if (code->enclosure == -1)
+		return code->upval_cnt == 0;
+	struct code* enclosure = &((struct code*)readptr(cpu->code))[code->enclosure];
+	for (int i = 0; i < code->upval_cnt; i++) {
+		if (defs[i].in_stack > 1)
+			return 0;
+		if (!defs[i].in_stack && defs[i].idx >= enclosure->upval_cnt)
+			return 0;
+		if (defs[i].in_stack && (defs[i].idx == 2 + enclosure->nargs || defs[i].idx == 3 + enclosure->nargs))
+			return 0;
+	}
+	return 1;
+}
+
+/* Without a file only checks whether the code can be saved */
+int compile_save(struct cpu* cpu, const char* src, int srclen, uint32_t hash, void* f) {
+	struct code_cache cc = { f, CODE_CACHE_SUM_SEED };
+	struct tabobj* globals = (struct tabobj*)readptr(cpu->globals);
+	struct code_cache_header header = {
+		CODE_CACHE_MAGIC, COXEL_CODE_VERSION, hash, srclen, cpu->code_cnt, globals->entry_top
+	};
+	if (!cache_write(&cc, &header, sizeof(header)) || !cache_write(&cc, src, srclen))
+		return 0;
+	struct tabent* entries = (struct tabent*)readptr_nullable(globals->entry);
+	for (int i = 0; i < globals->entry_top; i++)
+		if (!cache_write_str(&cc, (struct strobj*)readptr_nullable(entries[i].key)))
+			return 0;
+	for (int i = 0; i < cpu->code_cnt; i++) {
+		struct code* code = &((struct code*)readptr(cpu->code))[i];
+		if (!cache_write_int(&cc, code->nargs) ||
+			!cache_write_int(&cc, code->enclosure) ||
+			!cache_write_str(&cc, (struct strobj*)readptr_nullable(code->name)) ||
+			!cache_write_int(&cc, code->ins_cnt) ||
+			!cache_write(&cc, readptr_nullable(code->ins), code->ins_cnt * sizeof(struct ins)) ||
+			!cache_write_int(&cc, code->lineinfo_cnt) ||
+			!cache_write(&cc, readptr_nullable(code->lineinfo), code->lineinfo_cnt * sizeof(struct licmd)) ||
+			!cache_write_int(&cc, code->upval_cnt) ||
+			!cache_write(&cc, readptr_nullable(code->upval), code->upval_cnt * sizeof(struct updef)) ||
+			!cache_write_int(&cc, code->k_cnt))
+			return 0;
+		if (code->k_cnt == 0)
+			continue;
+		uint8_t* kinds = (uint8_t*)mem_alloc(&cpu->alloc, code->k_cnt);
+		if (kinds == NULL)
+			return 0;
+		cpu_const_kinds(cpu, code, kinds);
+		uint32_t* k = (uint32_t*)readptr(code->k);
+		int ok = 1;
+		for (int j = 0; ok && j < code->k_cnt; j++) {
+			/* a string whose offset equals a number constant shares its slot */
+			if (kinds[j] == 3)
+				ok = 0;
+			else if (kinds[j] == 1)
+				ok = cache_write_int(&cc, 1) && cache_write_str(&cc, (struct strobj*)forcereadptr(k[j]));
+			else
+				ok = cache_write_int(&cc, 0) && cache_write_int(&cc, k[j]);
+		}
+		mem_dealloc(&cpu->alloc, kinds);
+		if (!ok)
+			return 0;
+	}
+	uint32_t sum = cc.sum;
+	return cache_write_int(&cc, sum);
+}
+
+int compile_load(struct cpu* cpu, const char* src, int srclen, uint32_t hash, void* f) {
+	struct code_cache cc = { f, CODE_CACHE_SUM_SEED };
+	struct code_cache_header header;
+	if (!cache_read(&cc, &header, sizeof(header)) ||
+		header.magic != CODE_CACHE_MAGIC || header.version != COXEL_CODE_VERSION ||
+		header.hash != hash || header.codelen != srclen ||
+		header.code_cnt <= 0 || header.global_cnt < 0 || cpu->code_cnt != 0 ||
+		!cache_read_src(&cc, src, srclen))
+		return 0;
+	struct tabobj* globals = (struct tabobj*)readptr(cpu->globals);
+	for (int i = 0; i < header.global_cnt; i++) {
+		struct strobj* name;
+		if (!cache_read_str(cpu, &cc, &name) || name == NULL || tab_reserve(cpu, globals, name) != i)
+			return 0;
+	}
+	for (int i = 0; i < header.code_cnt; i++) {
+		add_code(cpu);
+		struct code* code = &((struct code*)readptr(cpu->code))[i];
+		uint32_t nargs, enclosure, cnt;
+		struct strobj* name;
+		if (!cache_read_int(&cc, &nargs) || !cache_read_int(&cc, &enclosure) || !cache_read_str(cpu, &cc, &name))
+			return 0;
+		/* functions come after the function they are in */
+		if (i == 0 ? (int)enclosure != -1 : enclosure >= (uint32_t)i)
+			return 0;
+		code->nargs = nargs;
+		code->enclosure = enclosure;
+		code->name = writeptr_nullable(name);
+		if (!cache_read_int(&cc, &cnt) || cnt == 0)
+			return 0;
+		code->ins = writeptr_nullable(cache_read_vec(cpu, &cc, cnt, sizeof(struct ins)));
+		if (!code->ins)
+			return 0;
+		code->ins_cnt = code->ins_cap = cnt;
+		if (!cache_read_int(&cc, &cnt))
+			return 0;
+		code->lineinfo = writeptr_nullable(cache_read_vec(cpu, &cc, cnt, sizeof(struct licmd)));
+		if (cnt && !code->lineinfo)
+			return 0;
+		code->lineinfo_cnt = code->lineinfo_cap = cnt;
+		if (!cache_read_int(&cc, &cnt))
+			return 0;
+		code->upval = writeptr_nullable(cache_read_vec(cpu, &cc, cnt, sizeof(struct updef)));
+		if (cnt && !code->upval)
+			return 0;
+		code->upval_cnt = code->upval_cap = cnt;
+		if (!cache_check_upvals(cpu, code))
+			return 0;
+		if (!cache_read_int(&cc, &cnt) || cnt > MAX_K + 1)
+			return 0;
+		uint32_t* k = cnt ? (uint32_t*)mem_alloc(&cpu->alloc, cnt * sizeof(uint32_t)) : NULL;
+		uint8_t* kinds = cnt ? (uint8_t*)mem_alloc(&cpu->alloc, cnt) : NULL;
+		if (cnt && (!k || !kinds))
+			return 0;
+		code->k = writeptr_nullable(k);
+		code->k_cnt = code->k_cap = cnt;
+		int ok = 1;
+		for (uint32_t j = 0; ok && j < cnt; j++) {
+			uint32_t tag;
+			struct strobj* str;
+			if (!cache_read_int(&cc, &tag))
+				ok = 0;
+			else if (tag == 0) {
+				kinds[j] = 2;
+				ok = cache_read_int(&cc, &k[j]);
+			}
+			else if (tag != 1 || !cache_read_str(cpu, &cc, &str) || str == NULL)
+				ok = 0;
+			else {
+				kinds[j] = 1;
+				k[j] = forcewriteptr(str);
+			}
+		}
+		ok = ok && cpu_check_code(cpu, code, header.code_cnt, kinds);
+		mem_dealloc(&cpu->alloc, kinds);
+		if (!ok)
+			return 0;
+		finish_code_impl(cpu, code);
+	}
+	/* a function is created by the function it is in, whose upvalues it takes */
+	for (int i = 0; i < header.code_cnt; i++) {
+		struct code* codes = (struct code*)readptr(cpu->code);
+		struct ins* ins = (struct ins*)readptr(codes[i].ins);
+		for (int pc = 0; pc < codes[i].ins_cnt; pc++)
+			if (ins[pc].opcode == op_func && codes[ins[pc].imm].enclosure != i)
+				return 0;
+	}
+	uint32_t sum = cc.sum, stored;
+	if (!cache_read_int(&cc, &stored) || stored != sum)
+		return 0;
+	set_topfunc(cpu, 0);
+	return 1;
+}
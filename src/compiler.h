@@ -8,5 +8,7 @@ struct compile_err {
 	const char* msg;
 };
 struct compile_err compile(struct cpu* cpu, const char* code, int codelen);
+int compile_save(struct cpu* cpu, const char* src, int srclen, uint32_t hash, void* f);
+int compile_load(struct cpu* cpu, const char* src, int srclen, uint32_t hash, void* f);
 
 #endif
@@ -5,13 +5,20 @@
 #include <stdint.h>
 
 #define COXEL_STATE_MAGIC		' xoc'
-#define COXEL_STATE_VERSION		0
+#define COXEL_STATE_VERSION		14
+/* Bump when opcodes or the cached code format change, see compiler.c */
+#define COXEL_CODE_VERSION		4
 
 /* Debug helpers */
 
 //#define DEBUG_NULLABLE_PTR
 //#define DEBUG_TIMING
 
+/* Runtime switchable opcode profiler, see profile.h */
+#if !defined(ESP_PLATFORM)
+#define CPU_PROFILE
+#endif
+
 #ifdef DEBUG_TIMING
 
 #if defined(_M_IX86) || defined(__i386__) || defined(_M_X64) || defined(__x86_64__)
@@ -89,7 +96,7 @@ static FORCEINLINE uint32_t rotl32(uint32_t x, int8_t r) {
 
 /* Count leading/trailing zeros */
 #if defined(__GNUC__)
-#define mostbitidx(x)	__builtin_clz(x)
+#define mostbitidx(x)	(31 - __builtin_clz(x))
 #define leastbitidx(x)	__builtin_ctz(x)
 #elif defined(_MSC_VER)
 #include <intrin.h>
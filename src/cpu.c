@@ -7,7 +7,10 @@
 #include "gfx.h"
 #include "lib.h"
 #include "platform.h"
+#include "profile.h"
+#include "shape.h"
 #include "str.h"
+#include "strbuf.h"
 #include "tab.h"
 
 #include <setjmp.h>
@@ -104,13 +107,25 @@ struct cpu* cpu_new(int pid) {
 	cpu->sweepcur = writeptr_nullable(NULL);
 	cpu->gcstate = gs_reset;
 	cpu->gcwhite = 0;
+	cpu->oldhead = writeptr_nullable(NULL);
+	cpu->minor_base = 0;
+	cpu->major_threshold = GC_MIN_THRESHOLD;
+	cpu->gcdebt = 0;
+	cpu->gcpause = GC_PAUSE;
+	cpu->gcstepmul = GC_STEPMUL;
+	cpu->gcrequest = 0;
+	cpu->gcheld = 0;
 	cpu->parent = -1;
 	cpu->cycles = 0;
 	cpu->top_executed = 0;
 	cpu->paused = 0;
 	cpu->stopped = 0;
+	cpu->curfunc = writeptr_nullable(NULL);
 	strtab_init(cpu);
+	cpu->shape_root = writeptr(shape_new_root(cpu));
+	/* Globals are accessed by entry index, see gslot */
 	struct tabobj* globals = tab_new(cpu);
+	tab_to_dict(cpu, globals);
 	cpu->globals = writeptr(globals);
 	cpu->overlay_state = writeptr_nullable(NULL);
 	cpu->code = writeptr_nullable(NULL);
@@ -127,6 +142,10 @@ struct cpu* cpu_new(int pid) {
 #define X(s) cpu->_lit_##s = writeptr(str_intern_nogc(cpu, #s, (sizeof #s) - 1));
 	STRLIT_DEF(X);
 #undef X
+	for (int i = 0; i < STRCHR_CNT; i++) {
+		char ch = (char)(STRCHR_FIRST + i);
+		cpu->_chr[i] = writeptr(str_intern_nogc(cpu, &ch, 1));
+	}
 	lib_init(cpu);
 	gfx_init(&cpu->gfx);
 	tab_set(cpu, globals, LIT(global), value_tab(globals));
@@ -144,13 +163,17 @@ void cpu_destroy(struct cpu* cpu) {
 }
 
 static void cpu_growstack(struct cpu* cpu) {
-	int new_cap = cpu->stack_cap == 0 ? 1024 : cpu->stack_cap * 2;
+	int old_cap = cpu->stack_cap;
+	int new_cap = old_cap == 0 ? 1024 : old_cap * 2;
 	value_t* old_stack = (value_t*)readptr_nullable(cpu->stack);
 	value_t* new_stack = (value_t*)mem_realloc(&cpu->alloc, old_stack, new_cap * sizeof(value_t));
 	cpu->stack = writeptr(new_stack);
 	cpu->stack_cap = new_cap;
+	/* the collector scans stale slots too */
+	for (int i = old_cap; i < new_cap; i++)
+		new_stack[i] = value_undef();
 	/* adjust open upvalues */
-	for (struct upval* val = readptr_nullable(cpu->upval_open); val; val = readptr(val->next))
+	for (struct upval* val = readptr_nullable(cpu->upval_open); val; val = readptr_nullable(val->next))
 		val->val = writeptr((value_t*)readptr(val->val) - old_stack + new_stack);
 }
 
@@ -204,6 +227,7 @@ FORCEINLINE struct strobj* to_string(struct cpu* cpu, value_t val) {
 			return LIT(false);
 	}
 	case t_str: return (struct strobj*)value_get_object(val);
+	case t_strbuf: return strbuf_intern(cpu, (struct strbufobj*)value_get_object(val));
 	default: runtime_error(cpu, "Cannot convert to string.");
 	}
 }
@@ -214,6 +238,12 @@ FORCEINLINE struct arrobj* to_arr(struct cpu* cpu, value_t val) {
 	return (struct arrobj*)value_get_object(val);
 }
 
+struct strbufobj* to_strbuf(struct cpu* cpu, value_t val) {
+	if (unlikely(value_get_type(val) != t_strbuf))
+		runtime_error(cpu, "Not a string buffer.");
+	return (struct strbufobj*)value_get_object(val);
+}
+
 FORCEINLINE struct tabobj* to_tab(struct cpu* cpu, value_t val) {
 	if (unlikely(value_get_type(val) != t_tab))
 		runtime_error(cpu, "Not an object.");
@@ -246,6 +276,30 @@ static FORCEINLINE struct strobj* get_typeof(struct cpu* cpu, value_t val) {
 	}
 }
 
+/* Whole number keys need no string while the array part covers them */
+static FORCEINLINE value_t tab_getnum(struct cpu* cpu, struct tabobj* tab, number num) {
+	if (likely(num_is_index(num))) {
+		int index = num_index(num);
+		cpu->cycles -= CYCLES_ARRAY_LOOKUP;
+		if (likely(index < tab->arr_cnt))
+			return value_unhole(((value_t*)readptr(tab->arr))[index]);
+		if (!tab->hidx_cnt)
+			return value_undef();
+	}
+	cpu->cycles -= CYCLES_LOOKUP;
+	return tab_get(cpu, tab, num_to_str(cpu, num));
+}
+
+static FORCEINLINE void tab_setnum(struct cpu* cpu, struct tabobj* tab, number num, value_t value) {
+	if (likely(num_is_index(num))) {
+		cpu->cycles -= CYCLES_ARRAY_LOOKUP;
+		if (likely(tab_set_index(cpu, tab, num_index(num), value)))
+			return;
+	}
+	cpu->cycles -= CYCLES_LOOKUP;
+	tab_set(cpu, tab, num_to_str(cpu, num), value);
+}
+
 static FORCEINLINE value_t fget(struct cpu* cpu, value_t obj, value_t field) {
 	switch (value_get_type(obj)) {
 	case t_str: {
@@ -259,6 +313,10 @@ static FORCEINLINE value_t fget(struct cpu* cpu, value_t obj, value_t field) {
 			return str_fget(cpu, str, to_string(cpu, field));
 		}
 	}
+	case t_strbuf: {
+		cpu->cycles -= CYCLES_LOOKUP;
+		return strbuf_fget(cpu, (struct strbufobj*)value_get_object(obj), to_string(cpu, field));
+	}
 	case t_buf: {
 		struct bufobj* buf = (struct bufobj*)value_get_object(obj);
 		if (likely(value_is_num(field))) {
@@ -283,6 +341,8 @@ static FORCEINLINE value_t fget(struct cpu* cpu, value_t obj, value_t field) {
 	}
 	case t_tab: {
 		struct tabobj* tab = (struct tabobj*)value_get_object(obj);
+		if (value_is_num(field))
+			return tab_getnum(cpu, tab, value_get_num(field));
 		cpu->cycles -= CYCLES_LOOKUP;
 		return tab_get(cpu, tab, to_string(cpu, field));
 	}
@@ -311,11 +371,9 @@ static FORCEINLINE value_t fgetnum(struct cpu* cpu, value_t obj, number field) {
 		return arr_get(cpu, (struct arrobj*)value_get_object(obj), field);
 	}
 
-	case t_tab: {
-		cpu->cycles -= CYCLES_LOOKUP;
-		return tab_get(cpu, (struct tabobj*)value_get_object(obj), num_to_str(cpu, field));
-	}
+	case t_tab: return tab_getnum(cpu, (struct tabobj*)value_get_object(obj), field);
 
+	case t_strbuf:
 	case t_assetmap:
 		return value_undef();
 
@@ -323,13 +381,14 @@ static FORCEINLINE value_t fgetnum(struct cpu* cpu, value_t obj, number field) {
 	}
 }
 
-static FORCEINLINE value_t fgetstr(struct cpu* cpu, value_t obj, struct strobj* field) {
+static FORCEINLINE value_t fgetstr(struct cpu* cpu, value_t obj, struct strobj* field, uint16_t* cache) {
 	cpu->cycles -= CYCLES_LOOKUP;
 	switch (value_get_type(obj)) {
 	case t_str: return str_fget(cpu, (struct strobj*)value_get_object(obj), field);
+	case t_strbuf: return strbuf_fget(cpu, (struct strbufobj*)value_get_object(obj), field);
 	case t_buf: return buf_fget(cpu, (struct bufobj*)value_get_object(obj), field);
 	case t_arr: return arr_fget(cpu, (struct arrobj*)value_get_object(obj), field);
-	case t_tab: return tab_get(cpu, (struct tabobj*)value_get_object(obj), field);
+	case t_tab: return tab_get_cached(cpu, (struct tabobj*)value_get_object(obj), field, cache);
 	case t_assetmap: return assetmap_fget(cpu, (struct assetmapobj*)value_get_object(obj), field);
 	default: runtime_error(cpu, "Not an object.");
 	}
@@ -340,7 +399,16 @@ static FORCEINLINE void fset(struct cpu* cpu, value_t obj, value_t field, value_
 	case t_str: runtime_error(cpu, "Cannot set string element.");
 	case t_buf: buf_set(cpu, (struct bufobj*)value_get_object(obj), to_number(cpu, field), value); cpu->cycles -= CYCLES_ARRAY_LOOKUP; break;
 	case t_arr: arr_set(cpu, (struct arrobj*)value_get_object(obj), to_number(cpu, field), value); cpu->cycles -= CYCLES_ARRAY_LOOKUP; break;
-	case t_tab: tab_set(cpu, (struct tabobj*)value_get_object(obj), to_string(cpu, field), value); cpu->cycles -= CYCLES_LOOKUP;  break;
+	case t_tab: {
+		struct tabobj* tab = (struct tabobj*)value_get_object(obj);
+		if (value_is_num(field))
+			tab_setnum(cpu, tab, value_get_num(field), value);
+		else {
+			tab_set(cpu, tab, to_string(cpu, field), value);
+			cpu->cycles -= CYCLES_LOOKUP;
+		}
+		break;
+	}
 	case t_assetmap: runtime_error(cpu, "Setting immutable object.");
 	default: runtime_error(cpu, "Not an object.");
 	}
@@ -351,13 +419,13 @@ static FORCEINLINE void fsetn(struct cpu* cpu, value_t obj, number field, value_
 	case t_str: runtime_error(cpu, "Cannot set string element.");
 	case t_buf: buf_set(cpu, (struct bufobj*)value_get_object(obj), field, value); cpu->cycles -= CYCLES_ARRAY_LOOKUP; break;
 	case t_arr: arr_set(cpu, (struct arrobj*)value_get_object(obj), field, value); cpu->cycles -= CYCLES_ARRAY_LOOKUP; break;
-	case t_tab: tab_set(cpu, (struct tabobj*)value_get_object(obj), num_to_str(cpu, field), value); cpu->cycles -= CYCLES_LOOKUP; break;
+	case t_tab: tab_setnum(cpu, (struct tabobj*)value_get_object(obj), field, value); break;
 	case t_assetmap: runtime_error(cpu, "Setting immutable object.");
 	default: runtime_error(cpu, "Not an object.");
 	}
 }
 
-static FORCEINLINE void fsets(struct cpu* cpu, value_t obj, struct strobj* field, value_t value) {
+static FORCEINLINE void fsets(struct cpu* cpu, value_t obj, struct strobj* field, value_t value, uint16_t* cache) {
 	switch (value_get_type(obj)) {
 	case t_str:
 	case t_buf:
@@ -365,7 +433,7 @@ static FORCEINLINE void fsets(struct cpu* cpu, value_t obj, struct strobj* field
 		runtime_error(cpu, "Can only set string field on tables.");
 
 	case t_tab:
-		tab_set(cpu, (struct tabobj*)value_get_object(obj), field, value);
+		tab_set_cached(cpu, (struct tabobj*)value_get_object(obj), field, value, cache);
 		cpu->cycles -= CYCLES_LOOKUP;
 		break;
 
@@ -374,6 +442,20 @@ static FORCEINLINE void fsets(struct cpu* cpu, value_t obj, struct strobj* field
 	}
 }
 
+static FORCEINLINE void fdel(struct cpu* cpu, value_t obj, value_t field) {
+	if (value_get_type(obj) != t_tab)
+		runtime_error(cpu, "Can only delete table fields.");
+	struct tabobj* tab = (struct tabobj*)value_get_object(obj);
+	if (value_is_num(field) && num_is_index(value_get_num(field)) && num_index(value_get_num(field)) < tab->arr_cnt) {
+		cpu->cycles -= CYCLES_ARRAY_LOOKUP;
+		tab_delete_index(cpu, tab, num_index(value_get_num(field)));
+	}
+	else {
+		cpu->cycles -= CYCLES_LOOKUP;
+		tab_delete(cpu, tab, to_string(cpu, field));
+	}
+}
+
 static void upval_unlink(struct cpu* cpu, struct upval* val) {
 	struct upval* prev = readptr_nullable(val->prev);
 	if (prev)
@@ -395,6 +477,7 @@ static void close_upvals(struct cpu* cpu, value_t* frame, int base) {
 			upval_unlink(cpu, val);
 			val->val_holder = *v;
 			val->val = writeptr(&val->val_holder);
+			gc_barrier(cpu, val, *v);
 		}
 		val = next;
 		cnt++;
@@ -402,82 +485,66 @@ static void close_upvals(struct cpu* cpu, value_t* frame, int base) {
 	cpu->cycles -= CYCLES_UPVALUES(cnt);
 }
 
-static value_t get_iter(struct cpu* cpu, value_t val) {
-	switch (value_get_type(val)) {
-	case t_str: {
-		struct strobj* str = (struct strobj*)value_get_object(val);
-		struct striterobj* striter = (struct striterobj*)gc_alloc(cpu, t_striter, sizeof(struct striterobj));
-		striter->str = writeptr(str);
-		striter->i = 0;
-		striter->end = str->len;
-		return value_striter(striter);
-	}
-
-	case t_arr: {
-		struct arrobj* arr = (struct arrobj*)value_get_object(val);
-		struct arriterobj* arriter = (struct arriterobj*)gc_alloc(cpu, t_arriter, sizeof(struct arriterobj));
-		arriter->arr = writeptr(arr);
-		arriter->i = 0;
-		arriter->end = arr->len;
-		return value_arriter(arriter);
-	}
+/* Iterators live in two registers: the iterated object followed by a cursor.
+ * for...in iterates keys, which are indices for strings and arrays and
+ * strings for tables, whichever part of the table holds them */
+#define ITER_KEYS	(1u << 23)
 
-	default:
+static FORCEINLINE void iter_init(struct cpu* cpu, value_t* iter, value_t val, int keys) {
+	if (value_get_type(val) != t_str && value_get_type(val) != t_arr && value_get_type(val) != t_tab)
 		runtime_error(cpu, "The object does not have built-in iterator support.");
-	}
+	iter[0] = val;
+	iter[1] = value_cursor(keys ? ITER_KEYS : 0);
 }
 
-static int iter_next(struct cpu* cpu, value_t iterval, value_t* val) {
-	switch (value_get_type(iterval)) {
-	case t_striter: {
-		struct striterobj* striter = (struct striterobj*)value_get_object(iterval);
-		struct strobj* str = (struct strobj*)readptr(striter->str);
-		if (striter->i == -1 || striter->i >= str->len) {
-			striter->i = -1;
+static FORCEINLINE int iter_next(struct cpu* cpu, value_t* iter, value_t* val) {
+	uint32_t keys = value_get_cursor(iter[1]) & ITER_KEYS;
+	uint32_t i = value_get_cursor(iter[1]) & ~ITER_KEYS;
+	if (value_get_type(iter[0]) == t_tab) {
+		value_t key, value;
+		if (!tab_next(cpu, (struct tabobj*)value_get_object(iter[0]), &i, &key, &value)) {
 			*val = value_undef();
 			return 1;
 		}
-		else {
-			*val = value_str(str_intern(cpu, &str->data[striter->i], 1));
-			if (++striter->i == str->len)
-				striter->i = -1;
-			return 0;
-		}
+		iter[1] = value_cursor(keys | i);
+		if (keys && value_is_num(key))
+			key = value_str(num_to_str(cpu, value_get_num(key)));
+		*val = keys ? key : value;
+		return 0;
 	}
-	case t_arriter: {
-		struct arriterobj* arriter = (struct arriterobj*)value_get_object(iterval);
-		struct arrobj* arr = (struct arrobj*)readptr(arriter->arr);
-		if (arriter->i == -1 || arriter->i >= arr->len) {
-			arriter->i = -1;
+	if (value_get_type(iter[0]) == t_arr) {
+		struct arrobj* arr = (struct arrobj*)value_get_object(iter[0]);
+		if (i >= arr->len) {
 			*val = value_undef();
 			return 1;
 		}
-		else {
-			struct arrobj* arr = (struct arrobj*)readptr(arriter->arr);
-			*val = ((value_t*)readptr(arr->data))[arriter->i];
-			if (++arriter->i == arr->len)
-				arriter->i = -1;
-			return 0;
-		}
+		*val = keys ? value_num(num_kuint((uint16_t)i)) : ((value_t*)readptr(arr->data))[i];
 	}
-	default:
-		runtime_error(cpu, "Not an iterator object.");
+	else {
+		struct strobj* str = (struct strobj*)value_get_object(iter[0]);
+		if (i >= str->len) {
+			*val = value_undef();
+			return 1;
+		}
+		*val = keys ? value_num(num_kuint((uint16_t)i)) : value_str(str_char(cpu, &str->data[i]));
 	}
+	iter[1] = value_cursor(keys | (i + 1));
+	return 0;
 }
 
 void func_destroy(struct cpu* cpu, struct funcobj* func) {
-	mem_dealloc(&cpu->alloc, func);
+	mem_dealloc_pooled(&cpu->alloc, func);
 }
 
 void upval_destroy(struct cpu* cpu, struct upval* upval) {
 	/* Open upval ? unlink it */
 	if (readptr(upval->val) != &upval->val_holder)
 		upval_unlink(cpu, upval);
-	mem_dealloc(&cpu->alloc, upval);
+	mem_dealloc_pooled(&cpu->alloc, upval);
 }
 
 #define update_stack()	do { \
-	if (unlikely(cpu->sp + 256 > cpu->stack_cap)) \
+	if (unlikely(cpu->sp + CPU_FRAME_SIZE > cpu->stack_cap)) \
 		cpu_growstack(cpu); \
 		frame = &((value_t*)readptr(cpu->stack))[cpu->sp]; \
 	} while (0)
@@ -498,11 +565,20 @@ void upval_destroy(struct cpu* cpu, struct upval* upval) {
 #define retvalstr	to_string(cpu, retval)
 #define lvalstr		to_string(cpu, lval)
 #define rvalstr		to_string(cpu, rval)
+#define retnum		((number)ktable[iop1])
 #define lnum		((number)ktable[iop2])
 #define rnum		((number)ktable[iop3])
 #define retstr		forcereadptr(ktable[iop1])
 #define lstr		forcereadptr(ktable[iop2])
 #define rstr		forcereadptr(ktable[iop3])
+/* take the following j if cond holds, skip it otherwise */
+#define condjump(cond)	do { if (cond) pc += 1 + IMM(*pc); else pc++; } while (0)
+/* global slot resolved by the compiler */
+#define gslot		(((struct tabent*)readptr(((struct tabobj*)readptr(cpu->globals))->entry))[(uint16_t)iimm])
+/* inline cache slot of the current instruction */
+#define icslot		(&((uint16_t*)readptr(code->icache))[pc - (uint32_t*)readptr(code->ins) - 1])
+/* cycles of the basic block from pc to its end */
+#define blkcost		(((uint16_t*)readptr(code->blkcost))[pc - (uint32_t*)readptr(code->ins)] * CYCLES_BASE)
 
 #ifdef DEBUG_TIMING
 static NOINLINE void cpu_timing_record(enum opcode opcode, int64_t duration);
@@ -531,6 +607,7 @@ void cpu_execute(struct cpu* cpu, struct funcobj* func, int nargs, ...) {
 	cpu->curfunc = writeptr(func);
 	cpu->curpc = 0;
 	cpu->cycles = CYCLES_PER_FRAME;
+	cpu->gcrequest = 0;
 	cpu_continue(cpu);
 }
 
@@ -548,20 +625,33 @@ void cpu_execute(struct cpu* cpu, struct funcobj* func, int nargs, ...) {
 #define COMPUTED_GOTO_DEBUG_TIMING_UPDATE()
 #endif
 
+/* Cycles are charged per basic block: instructions ending a block use
+ * BRANCH() to pay for the whole next block up front. When the budget cannot
+ * cover it, the block is stepped through one instruction at a time so the
+ * timeout stops at exactly the same pc as per instruction accounting. Extra
+ * cycles spent inside a block are settled at the next block boundary. */
 #if defined(USE_COMPUTED_GOTO)
 #define DISPATCH()	do { \
 		COMPUTED_GOTO_DEBUG_TIMING_UPDATE(); \
-		if (likely(cpu->cycles > 0)) { \
-			cpu->cycles -= CYCLES_BASE; \
-			ins = *pc++; \
-			goto *local_dispatch_table[iopcode]; \
+		ins = *pc++; \
+		goto *local_dispatch_table[iopcode]; \
+	} while (0)
+#define BRANCH()	do { \
+		COMPUTED_GOTO_DEBUG_TIMING_UPDATE(); \
+		int cost = blkcost; \
+		if (likely(cpu->cycles >= cost)) { \
+			cpu->cycles -= cost; \
+			local_dispatch_table = block_dispatch_table; \
 		} \
-		cpu->dummy = __COUNTER__; \
-		goto timeout; \
+		else \
+			local_dispatch_table = step_dispatch_table; \
+		ins = *pc++; \
+		goto *local_dispatch_table[iopcode]; \
 	} while (0)
 #define CASE(op)	target_##op:
 #else
 #define DISPATCH()	break
+#define BRANCH()	break
 #define CASE(op)	case op:
 #endif
 
@@ -595,14 +685,39 @@ void cpu_continue(struct cpu* cpu) {
 	register void** local_dispatch_table asm("a2") = dispatch_table;
 #else
 	void** local_dispatch_table = dispatch_table;
+#endif
+	/* table to run a block with when its cost has been paid */
+	void** block_dispatch_table = dispatch_table;
+#ifdef CPU_PROFILE
+	if (unlikely(g_profile_enabled)) {
+		profile_begin();
+		block_dispatch_table = profile_dispatch_table;
+	}
 #endif
 #else
+#ifdef CPU_PROFILE
+	if (unlikely(g_profile_enabled))
+		profile_begin();
+#endif
 	for (;;) {
 #endif
 		uint32_t ins = 0;
 #if defined(USE_COMPUTED_GOTO)
-		DISPATCH();
+	resume:
+		BRANCH();
 		target_default: internal_error(cpu);
+		target_step:
+			if (unlikely(cpu->cycles <= 0)) {
+				pc--;
+				goto timeout;
+			}
+			cpu->cycles -= CYCLES_BASE;
+			goto *block_dispatch_table[iopcode];
+#ifdef CPU_PROFILE
+		target_profile:
+			profile_record(cpu, code, pc - 1);
+			goto *dispatch_table[iopcode];
+#endif
 #else
 #if defined(DEBUG_TIMING)
 		MEASURE_END();
@@ -610,12 +725,17 @@ void cpu_continue(struct cpu* cpu) {
 			cpu_timing_record(last_opcode, MEASURE_DURATION());
 		MEASURE_START();
 #endif
+	resume:
 		if (unlikely(cpu->cycles <= 0))
 			goto timeout;
 		cpu->cycles -= CYCLES_BASE;
 		ins = *pc++;
 #if defined(DEBUG_TIMING)
 		last_opcode = iopcode;
+#endif
+#ifdef CPU_PROFILE
+		if (unlikely(g_profile_enabled))
+			profile_record(cpu, code, pc - 1);
 #endif
 		switch (iopcode) {
 		default: internal_error(cpu);
@@ -740,26 +860,45 @@ void cpu_continue(struct cpu* cpu) {
 		CASE(op_tab) retval = value_tab(tab_new(cpu)); cpu->cycles -= CYCLES_ALLOC; DISPATCH();
 		CASE(op_fget) retval = fget(cpu, lval, rval); DISPATCH();
 		CASE(op_fgetn) retval = fgetnum(cpu, lval, rnum); DISPATCH();
-		CASE(op_fgets) retval = fgetstr(cpu, lval, rstr); DISPATCH();
+		CASE(op_fgets) retval = fgetstr(cpu, lval, rstr, icslot); DISPATCH();
 		CASE(op_fset) fset(cpu, retval, lval, rval); DISPATCH();
 		CASE(op_fsetn) fsetn(cpu, retval, lnum, rval); DISPATCH();
-		CASE(op_fsets) fsets(cpu, retval, lstr, rval); DISPATCH();
-		CASE(op_gget) retval = tab_get(cpu, (struct tabobj*)readptr(cpu->globals), lvalstr); cpu->cycles -= CYCLES_LOOKUP; DISPATCH();
-		CASE(op_ggets) retval = tab_get(cpu, (struct tabobj*)readptr(cpu->globals), lstr); cpu->cycles -= CYCLES_LOOKUP; DISPATCH();
-		CASE(op_gset) tab_set(cpu, (struct tabobj*)readptr(cpu->globals), retvalstr, lval); cpu->cycles -= CYCLES_LOOKUP; DISPATCH();
-		CASE(op_gsets) tab_set(cpu, (struct tabobj*)readptr(cpu->globals), retstr, lval); cpu->cycles -= CYCLES_LOOKUP; DISPATCH();
+		CASE(op_fsets) fsets(cpu, retval, lstr, rval, icslot); DISPATCH();
+		CASE(op_fdel) fdel(cpu, lval, rval); retval = value_bool(1); DISPATCH();
+		CASE(op_gget) retval = value_unhole(gslot.value); DISPATCH();
+		CASE(op_gset) {
+			struct tabobj* globals = (struct tabobj*)readptr(cpu->globals);
+			gc_barrier(cpu, globals, retval);
+			gslot.value = retval;
+			DISPATCH();
+		}
 		CASE(op_uget) retval = *(value_t*)readptr(((struct upval*)readptr(func->upval[iop2]))->val); DISPATCH();
-		CASE(op_uset) *(value_t*)readptr(((struct upval*)readptr(func->upval[iop1]))->val) = lval; DISPATCH();
-		CASE(op_iter) retval = get_iter(cpu, lval); cpu->cycles -= CYCLES_ALLOC; DISPATCH();
-		CASE(op_next) retval = value_bool(iter_next(cpu, rval, &lval)); DISPATCH();
-		CASE(op_j) pc += iimm; DISPATCH();
+		CASE(op_uset) {
+			struct upval* upval = (struct upval*)readptr(func->upval[iop1]);
+			gc_barrier(cpu, upval, lval);
+			*(value_t*)readptr(upval->val) = lval;
+			DISPATCH();
+		}
+		CASE(op_iter) iter_init(cpu, &retval, lval, iop3); DISPATCH();
+		CASE(op_next) retval = value_bool(iter_next(cpu, &rval, &lval)); DISPATCH();
+		CASE(op_j) pc += iimm; BRANCH();
 		CASE(op_closej) {
 			close_upvals(cpu, frame, iop1);
 			pc += iimm;
-			DISPATCH();
+			BRANCH();
 		}
-		CASE(op_jtrue) if (retvalbool) pc += iimm; DISPATCH();
-		CASE(op_jfalse) if (!retvalbool) pc += iimm; DISPATCH();
+		CASE(op_jtrue) if (retvalbool) pc += iimm; BRANCH();
+		CASE(op_jfalse) if (!retvalbool) pc += iimm; BRANCH();
+		CASE(op_jlt) condjump((int32_t)retvalnum < (int32_t)lvalnum); BRANCH();
+		CASE(op_jltrn) condjump((int32_t)retvalnum < (int32_t)lnum); BRANCH();
+		CASE(op_jltnr) condjump((int32_t)retnum < (int32_t)lvalnum); BRANCH();
+		CASE(op_jge) condjump((int32_t)retvalnum >= (int32_t)lvalnum); BRANCH();
+		CASE(op_jgern) condjump((int32_t)retvalnum >= (int32_t)lnum); BRANCH();
+		CASE(op_jgenr) condjump((int32_t)retnum >= (int32_t)lvalnum); BRANCH();
+		CASE(op_jeq) condjump(strict_equal(cpu, retval, lval)); BRANCH();
+		CASE(op_jeqrn) condjump(strict_equal_num(cpu, retval, lnum)); BRANCH();
+		CASE(op_jne) condjump(!strict_equal(cpu, retval, lval)); BRANCH();
+		CASE(op_jnern) condjump(!strict_equal_num(cpu, retval, lnum)); BRANCH();
 		CASE(op_func) {
 			struct code* code = &((struct code*)readptr(cpu->code))[iimm];
 			struct funcobj* f = (struct funcobj*)gc_alloc(cpu, t_func,
@@ -833,7 +972,7 @@ void cpu_continue(struct cpu* cpu) {
 			}
 			else
 				runtime_error(cpu, "Not callable object.");
-			DISPATCH();
+			BRANCH();
 		}
 		CASE(op_retu)
 		CASE(op_ret) {
@@ -854,15 +993,21 @@ void cpu_continue(struct cpu* cpu) {
 			code = (struct code*)readptr(func->code);
 			ktable = (uint32_t*)readptr_nullable(code->k);
 			pc = &((uint32_t*)readptr(code->ins))[value_get_ci_pc(ci)];
-			DISPATCH();
+			BRANCH();
 		}
 #if !defined(USE_COMPUTED_GOTO)
 		} /* switch */
 	}
 #endif
 timeout:
-	cpu->cycles += CYCLES_PER_FRAME;
 	cpu->curfunc = writeptr(func);
+	/* The allocator took the cycles to stop at an instruction boundary */
+	if (cpu->gcrequest) {
+		gc_safepoint(cpu);
+		if (cpu->cycles > 0)
+			goto resume;
+	}
+	cpu->cycles += CYCLES_PER_FRAME;
 	cpu->curpc = (uint16_t)(pc - (uint32_t*)readptr(code->ins));
 	cpu->paused = 1;
 }
@@ -877,7 +1022,9 @@ enum operand_type {
 	ot_IMMNUM,
 	ot_IMMSTR,
 	ot_IMMFUNC,
+	ot_IMMGLOBAL,
 	ot_REL,
+	ot_JREL,
 };
 
 struct opcode_desc {
@@ -890,6 +1037,149 @@ static const struct opcode_desc opcode_desc[] = {
 };
 #undef X
 
+/* Code refers to string constants by k slot, which compaction does not update */
+void cpu_pin_consts(struct cpu* cpu) {
+	for (int i = 0; i < cpu->code_cnt; i++) {
+		struct code* code = &((struct code*)readptr(cpu->code))[i];
+		struct ins* inss = (struct ins*)readptr_nullable(code->ins);
+		uint32_t* k = (uint32_t*)readptr_nullable(code->k);
+		for (int pc = 0; pc < code->ins_cnt; pc++) {
+			struct ins* ins = &inss[pc];
+			const struct opcode_desc* desc = &opcode_desc[ins->opcode];
+			if (desc->op1 == ot_STR)
+				mem_set_pinned(&cpu->alloc, forcereadptr(k[ins->op1]));
+			if (desc->op2 == ot_STR)
+				mem_set_pinned(&cpu->alloc, forcereadptr(k[ins->op2]));
+			else if (desc->op2 == ot_IMMSTR)
+				mem_set_pinned(&cpu->alloc, forcereadptr(k[(uint16_t)ins->imm]));
+			if (desc->op3 == ot_STR)
+				mem_set_pinned(&cpu->alloc, forcereadptr(k[ins->op3]));
+			else if (desc->op3 == ot_JREL)
+				pc++; /* branch offset word */
+		}
+	}
+}
+
+/* Sets bit 1 in kinds for each constant read as a string, bit 2 as a number */
+void cpu_const_kinds(struct cpu* cpu, struct code* code, uint8_t* kinds) {
+	struct ins* inss = (struct ins*)readptr_nullable(code->ins);
+	memset(kinds, 0, code->k_cnt);
+	for (int pc = 0; pc < code->ins_cnt; pc++) {
+		struct ins* ins = &inss[pc];
+		const struct opcode_desc* desc = &opcode_desc[ins->opcode];
+		if (desc->op1 == ot_STR || desc->op1 == ot_NUM)
+			kinds[ins->op1] |= desc->op1 == ot_STR ? 1 : 2;
+		if (desc->op2 == ot_STR || desc->op2 == ot_NUM)
+			kinds[ins->op2] |= desc->op2 == ot_STR ? 1 : 2;
+		else if (desc->op2 == ot_IMMSTR || desc->op2 == ot_IMMNUM)
+			kinds[(uint16_t)ins->imm] |= desc->op2 == ot_IMMSTR ? 1 : 2;
+		if (desc->op3 == ot_STR || desc->op3 == ot_NUM)
+			kinds[ins->op3] |= desc->op3 == ot_STR ? 1 : 2;
+		else if (desc->op3 == ot_JREL)
+			pc++; /* branch offset word */
+	}
+}
+
+/* Registers 2 + nargs and 3 + nargs hold the function and the call info */
+static int check_regs(struct code* code, int first, int cnt) {
+	return first + cnt <= 2 + code->nargs || first >= 4 + code->nargs;
+}
+
+static int check_operand(struct code* code, const uint8_t* kinds, enum operand_type ot, int value) {
+	switch (ot) {
+	case ot_REG:
+		return check_regs(code, value, 1);
+	case ot_NUM:
+	case ot_IMMNUM:
+		return value >= 0 && value < code->k_cnt && kinds[value] == 2;
+	case ot_STR:
+	case ot_IMMSTR:
+		return value >= 0 && value < code->k_cnt && kinds[value] == 1;
+	default:
+		return 1;
+	}
+}
+
+/* Checks code that was not produced by the compiler, every operand has to
+ * stay inside the frame, the constants, the upvalues, the globals and the
+ * functions. kinds holds the kind of each constant as in cpu_const_kinds. */
+int cpu_check_code(struct cpu* cpu, struct code* code, int code_cnt, const uint8_t* kinds) {
+	struct ins* inss = (struct ins*)readptr_nullable(code->ins);
+	int global_cnt = ((struct tabobj*)readptr(cpu->globals))->entry_top;
+	if (code->ins_cnt <= 0 || code->nargs < 0 || code->nargs > CPU_FRAME_SIZE - 4)
+		return 0;
+	for (int pc = 0; pc < code->ins_cnt; pc++) {
+		struct ins* ins = &inss[pc];
+		if (ins->opcode >= op_CNT)
+			return 0;
+		const struct opcode_desc* desc = &opcode_desc[ins->opcode];
+		if (!check_operand(code, kinds, desc->op1, ins->op1))
+			return 0;
+		switch (desc->op2) {
+		case ot_IMMNUM:
+		case ot_IMMSTR:
+			if (!check_operand(code, kinds, desc->op2, ins->imm))
+				return 0;
+			break;
+		case ot_IMMFUNC:
+			if (ins->imm < 0 || ins->imm >= code_cnt)
+				return 0;
+			break;
+		case ot_IMMGLOBAL:
+			if ((uint16_t)ins->imm >= global_cnt)
+				return 0;
+			break;
+		case ot_REL:
+			if (pc + 1 + ins->imm < 0 || pc + 1 + ins->imm >= code->ins_cnt)
+				return 0;
+			break;
+		default:
+			if (!check_operand(code, kinds, desc->op2, ins->op2) ||
+				!check_operand(code, kinds, desc->op3, ins->op3))
+				return 0;
+			/* the offset word is checked as a j of its own */
+			if (desc->op3 == ot_JREL && (pc + 1 >= code->ins_cnt || inss[pc + 1].opcode != op_j))
+				return 0;
+		}
+		switch (ins->opcode) {
+		case op_uget:
+			if (ins->op2 >= code->upval_cnt)
+				return 0;
+			break;
+		case op_uset:
+			if (ins->op1 >= code->upval_cnt)
+				return 0;
+			break;
+		/* iterators take two registers */
+		case op_iter:
+			if (ins->op1 + 1 >= CPU_FRAME_SIZE || !check_regs(code, ins->op1, 2))
+				return 0;
+			break;
+		case op_next:
+			if (ins->op3 + 1 >= CPU_FRAME_SIZE || !check_regs(code, ins->op3, 2))
+				return 0;
+			break;
+		/* the function, this and the arguments */
+		case op_call:
+			if (ins->op1 + 2 + ins->op2 > CPU_FRAME_SIZE || !check_regs(code, ins->op1, 2 + ins->op2))
+				return 0;
+			break;
+		default:
+			break;
+		}
+	}
+	/* execution must not run past the last instruction */
+	switch (inss[code->ins_cnt - 1].opcode) {
+	case op_j:
+	case op_closej:
+	case op_ret:
+	case op_retu:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
 static char* dump_str(struct strobj* str, char* buf) {
 	int len = str->len;
 	if (len > 20)
@@ -1039,6 +1329,11 @@ static int dump_func(struct cpu* cpu, const char* codebuf, int codelen, int func
 			case ot_IMMFUNC:
 				cur += int_format(ins->imm, cur);
 				break;
+			case ot_IMMGLOBAL: {
+				struct tabent* ent = &((struct tabent*)readptr(((struct tabobj*)readptr(cpu->globals))->entry))[(uint16_t)ins->imm];
+				cur = dump_str((struct strobj*)readptr(ent->key), cur);
+				break;
+			}
 			case ot_IMMNUM: {
 				number num = (number)((uint32_t*)readptr(code->k))[ins->imm];
 				cur += num_format(num, 4, cur);
@@ -1050,7 +1345,12 @@ static int dump_func(struct cpu* cpu, const char* codebuf, int codelen, int func
 			}
 			default: {
 				cur = dump_operand(cpu, (uint32_t*)readptr(code->k), desc->op2, ins->op2, cur);
-				if (desc->op3 != ot__) {
+				if (desc->op3 == ot_JREL) {
+					*cur++ = ',';
+					*cur++ = ' ';
+					cur += int_format(pc + 1 + inss[pc].imm, cur);
+				}
+				else if (desc->op3 != ot__) {
 					*cur++ = ',';
 					*cur++ = ' ';
 					cur = dump_operand(cpu, (uint32_t*)readptr(code->k), desc->op3, ins->op3, cur);
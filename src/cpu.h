@@ -103,10 +103,8 @@
 	X(op_apush, "apush", REG, REG, _) \
 	X(op_tab, "tab", REG, _, _) \
 	/* global access */ \
-	X(op_gget, "gget", REG, REG, _) \
-	X(op_ggets, "gget", REG, STR, _) \
-	X(op_gset, "gset", REG, REG, _) \
-	X(op_gsets, "gset", STR, REG, _) \
+	X(op_gget, "gget", REG, IMMGLOBAL, _) \
+	X(op_gset, "gset", REG, IMMGLOBAL, _) \
 	/* field access */ \
 	X(op_fget, "fget", REG, REG, REG) \
 	X(op_fgets, "fget", REG, REG, STR) \
@@ -114,17 +112,29 @@
 	X(op_fset, "fset", REG, REG, REG) \
 	X(op_fsets, "fset", REG, STR, REG) \
 	X(op_fsetn, "fset", REG, NUM, REG) \
+	X(op_fdel, "fdel", REG, REG, REG) \
 	/* upvalue access */ \
 	X(op_uget, "uget", REG, IMM8, _) \
 	X(op_uset, "uset", IMM8, REG, _) \
 	/* iterator */ \
-	X(op_iter, "iter", REG, REG, _) \
+	X(op_iter, "iter", REG, REG, IMM8) \
 	X(op_next, "next", REG, REG, REG) \
 	/* control flow */ \
 	X(op_j, "j", _, REL, _) \
 	X(op_closej, "closej", REG, REL, _) \
 	X(op_jtrue, "jtrue", REG, REL, _) \
 	X(op_jfalse, "jfalse", REG, REL, _) \
+	/* compare and branch, the following j holds the target */ \
+	X(op_jlt, "jlt", REG, REG, JREL) \
+	X(op_jltrn, "jlt", REG, NUM, JREL) \
+	X(op_jltnr, "jlt", NUM, REG, JREL) \
+	X(op_jge, "jge", REG, REG, JREL) \
+	X(op_jgern, "jge", REG, NUM, JREL) \
+	X(op_jgenr, "jge", NUM, REG, JREL) \
+	X(op_jeq, "jeq", REG, REG, JREL) \
+	X(op_jeqrn, "jeq", REG, NUM, JREL) \
+	X(op_jne, "jne", REG, REG, JREL) \
+	X(op_jnern, "jne", REG, NUM, JREL) \
 	/* function */ \
 	X(op_func, "func", REG, IMMFUNC, _) \
 	X(op_close, "close", REG, _, _) \
@@ -166,6 +176,7 @@ enum gcstate {
 	gs_reset,
 	gs_mark,
 	gs_sweep,
+	gs_compact,
 };
 
 /* Line info VM format
@@ -196,6 +207,10 @@ struct code {
 	/* instructions */
 	int ins_cnt, ins_cap;
 	ptr_nullable(struct ins) ins;
+	/* inline caches, one entry per instruction */
+	ptr_nullable(uint16_t) icache;
+	/* instructions left until the end of the basic block, one entry per instruction */
+	ptr_nullable(uint16_t) blkcost;
 	/* line info */
 	int lineinfo_cnt, lineinfo_cap;
 	ptr_nullable(struct licmd) lineinfo;
@@ -228,11 +243,19 @@ struct funcobj {
 };
 
 #define CPU_MEM_SIZE	1048576
+/* registers addressable by an instruction, kept allocated above sp */
+#define CPU_FRAME_SIZE	256
 #define WIDTH	160
 #define HEIGHT	144
 
+/* Printable ASCII characters are interned up front as single character strings */
+#define STRCHR_FIRST	32
+#define STRCHR_CNT		96
+
 #define STRLIT_DEF(X) \
+	X(append) \
 	X(boolean) \
+	X(clear) \
 	X(data) \
 	X(draw) \
 	X(false) \
@@ -253,6 +276,7 @@ struct funcobj {
 	X(slice) \
 	X(string) \
 	X(substr) \
+	X(toString) \
 	X(true) \
 	X(undefined) \
 	X(width)
@@ -284,22 +308,30 @@ struct cpu {
 	int cycles;
 	int paused;
 	int stopped;
-	ptr(struct funcobj) curfunc;
+	ptr_nullable(struct funcobj) curfunc;
 	int curpc;
 
 	/* interned string hash table */
 	ptr(ptr_nullable(struct strobj)) strtab;
 	int strtab_size, strtab_cnt;
+	/* previous table while it is incrementally rehashed into strtab,
+	 * buckets below strtab_rehash are already moved */
+	ptr_nullable(ptr_nullable(struct strobj)) strtab_old;
+	int strtab_old_size, strtab_rehash;
 
 	/* interned string literals */
 	ptr(struct strobj) _lit_EMPTY;
 #define X(s) ptr(struct strobj) _lit_##s;
 	STRLIT_DEF(X)
 #undef X
+	ptr(struct strobj) _chr[STRCHR_CNT];
 
 	/* global table object (strong ref) */
 	ptr(struct tabobj) globals;
 
+	/* shape of empty tables (strong ref) */
+	ptr(struct shapeobj) shape_root;
+
 	/* overlay state object (strong ref) */
 	ptr_nullable(struct tabobj) overlay_state;
 
@@ -310,6 +342,16 @@ struct cpu {
 	ptr_nullable(uint32_t) sweepcur;
 	enum gcstate gcstate;
 	int gcwhite;
+	/* objects in gchead before oldhead are young, see gc.c */
+	ptr_nullable(struct obj) oldhead;
+	uint32_t minor_base; /* used memory after the last minor collection */
+	uint32_t major_threshold; /* used memory which starts a major cycle */
+	/* allocation debt pacing, see gc.h */
+	uint32_t gcdebt; /* bytes allocated since the last collector step */
+	int gcpause, gcstepmul;
+	/* a collection waits for the VM to reach an instruction boundary */
+	int gcrequest;
+	int gcheld; /* cycles held back until then */
 
 	/* stack additional info */
 	int sp, stack_cap;
@@ -366,8 +408,12 @@ int to_bool(struct cpu* cpu, value_t val);
 number to_number(struct cpu* cpu, value_t val);
 struct strobj* to_string(struct cpu* cpu, value_t val);
 struct arrobj* to_arr(struct cpu* cpu, value_t val);
+struct strbufobj* to_strbuf(struct cpu* cpu, value_t val);
 struct tabobj* to_tab(struct cpu* cpu, value_t val);
 struct assetmapobj* to_assetmap(struct cpu* cpu, value_t val);
+void cpu_pin_consts(struct cpu* cpu);
+void cpu_const_kinds(struct cpu* cpu, struct code* code, uint8_t* kinds);
+int cpu_check_code(struct cpu* cpu, struct code* code, int code_cnt, const uint8_t* kinds);
 void func_destroy(struct cpu* cpu, struct funcobj* func);
 void upval_destroy(struct cpu* cpu, struct upval* upval);
 
@@ -152,15 +152,17 @@ static void* dispatch_table[256] = {
 	&&target_default,
 	&&target_default,
 	&&target_default,
-	&&target_default,
-	&&target_default,
-	&&target_default,
-	&&target_default,
-	&&target_default,
-	&&target_default,
-	&&target_default,
-	&&target_default,
-	&&target_default,
-	&&target_default,
 };
 #undef X
+
+/* every opcode checks the budget first, used when a block does not fit */
+static void* step_dispatch_table[256] = {
+	[0 ... 255] = &&target_step,
+};
+
+#ifdef CPU_PROFILE
+/* every opcode goes through the profiler first */
+static void* profile_dispatch_table[256] = {
+	[0 ... 255] = &&target_profile,
+};
+#endif
@@ -3,12 +3,42 @@
 #include "buf.h"
 #include "gc.h"
 #include "platform.h"
+#include "shape.h"
 #include "str.h"
+#include "strbuf.h"
 #include "tab.h"
 
+#include <limits.h>
+
+/* Generations
+ * Between major cycles (gs_reset) old objects are black and young objects are
+ * white. Young objects are allocated in front of oldhead in gchead. Storing a
+ * young object into an old container shades it through the write barrier, so
+ * the gray list doubles as the remembered set. A minor collection traverses
+ * from the roots and the gray list, stopping at black objects, then sweeps the
+ * young objects only. Survivors stay black, which promotes them.
+ * A major cycle starts from an empty nursery and flips the colors, so all
+ * objects are white again. Objects allocated while it sweeps are black.
+ *
+ * Pacing
+ * Collection runs after every frame with the cycles the cart left over, and
+ * the major cycle additionally advances inside gc_alloc in proportion to the
+ * allocated bytes. Minor collections and phase changes are due regardless of
+ * the cycles left, but they need every live value to be reachable from the
+ * roots, which includes the VM stack. C code holds new objects in locals
+ * between allocations, so gc_alloc only requests them: it takes the cycles
+ * away, and the VM stops at the next instruction boundary to call
+ * gc_safepoint. Objects never move under a running VM, compaction waits for
+ * the end of the frame.
+ */
+
 struct obj* gc_alloc(struct cpu* cpu, enum type type, uint32_t size) {
-	struct obj* obj = (struct obj*)mem_alloc(&cpu->alloc, size);
-	obj->obj_header = make_obj_header(gm_white, type, readptr(cpu->gchead));
+	cpu->gcdebt += size;
+	if (unlikely(cpu->gcdebt >= GC_STEP_SIZE))
+		gc_step(cpu);
+	struct obj* obj = (struct obj*)mem_alloc_pooled(&cpu->alloc, size);
+	int mark = cpu->gcstate >= gs_sweep ? gm_black : gm_white;
+	obj->obj_header = make_obj_header(mark, type, readptr(cpu->gchead));
 	cpu->gchead = writeptr(obj);
 	return obj;
 }
@@ -26,24 +56,11 @@ static void gc_mark_gray(struct cpu* cpu, struct containerobj* obj) {
 void gc_mark_value(struct cpu* cpu, value_t value) {
 	switch (value_get_type(value)) {
 	case t_str:
+	case t_strbuf:
 	case t_buf:
 		gc_mark_black(cpu, (struct obj*)value_get_object(value));
 		break;
 
-	case t_striter: {
-		struct striterobj* striter = (struct striterobj*)value_get_object(value);
-		gc_mark_black(cpu, striter);
-		gc_mark_black(cpu, (struct strobj*)readptr(striter->str));
-		break;
-	}
-
-	case t_arriter: {
-		struct arriterobj* arriter = (struct arriterobj*)value_get_object(value);
-		gc_mark_black(cpu, arriter);
-		gc_mark_gray(cpu, (struct containerobj*)readptr(arriter->arr));
-		break;
-	}
-
 	case t_assetmap: {
 		struct assetmapobj* assetmap = (struct assetmapobj*)value_get_object(value);
 		gc_mark_black(cpu, assetmap);
@@ -61,6 +78,16 @@ void gc_mark_value(struct cpu* cpu, value_t value) {
 	}
 }
 
+void gc_mark_shape(struct cpu* cpu, struct shapeobj* shape) {
+	while (shape && obj_get_mark(shape) == gm_white) {
+		gc_mark_black(cpu, shape);
+		if (shape->key_cnt)
+			gc_mark_black(cpu, (struct strobj*)readptr(shape->keys[shape->key_cnt - 1]));
+		shape = (struct shapeobj*)readptr_nullable(shape->parent);
+		cpu->cycles -= CYCLES_TRAVERSE;
+	}
+}
+
 #define mark_value(value)	do { \
 	if (value_is_object(value)) \
 		gc_mark_value(cpu, value); \
@@ -78,17 +105,25 @@ static void gc_traverse_obj(struct cpu* cpu, struct containerobj* obj) {
 	}
 	case t_tab: {
 		struct tabobj* tab = (struct tabobj*)obj;
-		uint16_t* bucket = (uint16_t*)readptr(tab->bucket);
-		struct tabent* entries = (struct tabent*)readptr(tab->entry);
-		cpu->cycles -= tab->bucket_cnt * CYCLES_TRAVERSE;
-		for (int i = 0; i < tab->bucket_cnt; i++) {
-			for (uint16_t p = bucket[i]; p != TAB_NULL;) {
-				struct tabent* ent = &entries[p];
-				struct strobj* key = (struct strobj*)readptr(ent->key);
-				gc_mark_black(cpu, key);
+		struct tabent* entries = (struct tabent*)readptr_nullable(tab->entry);
+		value_t* arr = (value_t*)readptr_nullable(tab->arr);
+		for (int i = 0; i < tab->arr_cnt; i++)
+			mark_value(arr[i]);
+		struct shapeobj* shape = (struct shapeobj*)readptr_nullable(tab->shape);
+		if (shape) {
+			value_t* slot = (value_t*)readptr_nullable(tab->slot);
+			gc_mark_shape(cpu, shape);
+			for (int i = 0; i < shape->key_cnt; i++)
+				mark_value(slot[i]);
+			cpu->cycles -= shape->key_cnt * CYCLES_TRAVERSE;
+		}
+		cpu->cycles -= (tab->entry_top + tab->arr_cnt) * CYCLES_TRAVERSE;
+		for (int i = 0; i < tab->entry_top; i++) {
+			struct tabent* ent = &entries[i];
+			/* Deleted entries have no key */
+			if (ent->key) {
+				gc_mark_black(cpu, (struct strobj*)readptr(ent->key));
 				mark_value(ent->value);
-				p = ent->next;
-				cpu->cycles -= CYCLES_TRAVERSE;
 			}
 		}
 		break;
@@ -114,58 +149,352 @@ static void gc_traverse_obj(struct cpu* cpu, struct containerobj* obj) {
 void gc_free(struct cpu* cpu, struct obj* obj) {
 	switch (obj_get_type(obj)) {
 	case t_str: str_destroy(cpu, (struct strobj*)obj); return;
-	case t_striter: mem_dealloc(&cpu->alloc, obj); return;
+	case t_strbuf: strbuf_destroy(cpu, (struct strbufobj*)obj); return;
 	case t_buf: buf_destroy(cpu, (struct bufobj*)obj); return;
 	case t_arr: arr_destroy(cpu, (struct arrobj*)obj); return;
-	case t_arriter: mem_dealloc(&cpu->alloc, obj); return;
 	case t_tab: tab_destroy(cpu, (struct tabobj*)obj); return;
 	case t_func: func_destroy(cpu, (struct funcobj*)obj); return;
 	case t_upval: upval_destroy(cpu, (struct upval*)obj); return;
+	case t_shape: shape_destroy(cpu, (struct shapeobj*)obj); return;
 	default: platform_error("Internal gc error.");
 	}
 }
 
-void gc_collect(struct cpu* cpu) {
+/* Compact when more than half of the free memory is scattered in holes */
+#define COMPACT_MIN_HOLES	(CPU_MEM_SIZE / 32)
+#define COMPACT_QUOTA		(CPU_MEM_SIZE / 16) /* bytes moved per step */
+
+static int gc_fragmented(struct cpu* cpu) {
+	uint32_t holes = mem_holes(&cpu->alloc);
+	return holes >= COMPACT_MIN_HOLES && holes > cpu->alloc.topsize;
+}
+
+static void gc_compact_mark(struct cpu* cpu) {
+	struct alloc* alloc = &cpu->alloc;
+	for (struct obj* obj = readptr_nullable(cpu->gchead); obj; obj = obj_get_gcnext(obj)) {
+		mem_set_movable(alloc, obj);
+		switch (obj_get_type(obj)) {
+		case t_strbuf: mem_set_movable(alloc, readptr_nullable(((struct strbufobj*)obj)->data)); break;
+		case t_arr: mem_set_movable(alloc, readptr_nullable(((struct arrobj*)obj)->data)); break;
+		case t_tab: {
+			struct tabobj* tab = (struct tabobj*)obj;
+			mem_set_movable(alloc, readptr_nullable(tab->slot));
+			mem_set_movable(alloc, readptr_nullable(tab->entry));
+			mem_set_movable(alloc, readptr_nullable(tab->group));
+			mem_set_movable(alloc, readptr_nullable(tab->arr));
+			break;
+		}
+		}
+	}
+	mem_set_movable(alloc, readptr_nullable(cpu->stack));
+	mem_set_movable(alloc, readptr(cpu->strtab));
+	mem_set_movable(alloc, readptr_nullable(cpu->strtab_old));
+	struct code* codes = (struct code*)readptr_nullable(cpu->code);
+	mem_set_movable(alloc, codes);
+	for (int i = 0; i < cpu->code_cnt; i++) {
+		struct code* code = &codes[i];
+		mem_set_movable(alloc, readptr_nullable(code->ins));
+		mem_set_movable(alloc, readptr_nullable(code->icache));
+		mem_set_movable(alloc, readptr_nullable(code->blkcost));
+		mem_set_movable(alloc, readptr_nullable(code->lineinfo));
+		mem_set_movable(alloc, readptr_nullable(code->k));
+		mem_set_movable(alloc, readptr_nullable(code->upval));
+	}
+	/* Interned by the compiler, these may be collectable strings too */
+	cpu_pin_consts(cpu);
+}
+
+#define forward_ptr(field)		((field) = writeptr_nullable(mem_forward(c, readptr_nullable(field))))
+
+static FORCEINLINE value_t forward_value(struct cpu* cpu, const struct compact* c, value_t val) {
+	if (!value_is_object(val))
+		return val;
+	return value_type_object(value_get_type(val), mem_forward(c, value_get_object(val)));
+}
+
+static void forward_strtab(struct cpu* cpu, const struct compact* c, ptr_nullable(struct strobj)* strtab, int from, int size) {
+	for (int i = from; i < size; i++) {
+		struct strobj* p = readptr_nullable(strtab[i]);
+		forward_ptr(strtab[i]);
+		while (p) {
+			struct strobj* next = readptr_nullable(p->next);
+			forward_ptr(p->next);
+			p = next;
+		}
+	}
+}
+
+/* Update all references into the window, while everything is still in place */
+static int gc_compact_forward(struct cpu* cpu, const struct compact* c) {
+	int refs = 0;
+	/* Objects */
+	struct obj* obj = readptr_nullable(cpu->gchead);
+	forward_ptr(cpu->gchead);
+	while (obj) {
+		struct obj* next = obj_get_gcnext(obj);
+		obj->obj_header = obj_header_set_gcnext(obj->obj_header, mem_forward(c, next));
+		switch (obj_get_type(obj)) {
+		case t_strbuf: forward_ptr(((struct strbufobj*)obj)->data); break;
+		case t_arr: {
+			struct arrobj* arr = (struct arrobj*)obj;
+			value_t* data = (value_t*)readptr_nullable(arr->data);
+			for (uint32_t i = 0; i < arr->len; i++)
+				data[i] = forward_value(cpu, c, data[i]);
+			forward_ptr(arr->data);
+			refs += arr->len;
+			break;
+		}
+		case t_tab: {
+			struct tabobj* tab = (struct tabobj*)obj;
+			struct shapeobj* shape = (struct shapeobj*)readptr_nullable(tab->shape);
+			if (shape) {
+				value_t* slot = (value_t*)readptr_nullable(tab->slot);
+				for (int i = 0; i < shape->key_cnt; i++)
+					slot[i] = forward_value(cpu, c, slot[i]);
+				refs += shape->key_cnt;
+			}
+			struct tabent* entries = (struct tabent*)readptr_nullable(tab->entry);
+			for (int i = 0; i < tab->entry_top; i++) {
+				struct tabent* ent = &entries[i];
+				/* Deleted entries have no key */
+				if (ent->key) {
+					forward_ptr(ent->key);
+					ent->value = forward_value(cpu, c, ent->value);
+				}
+			}
+			value_t* arr = (value_t*)readptr_nullable(tab->arr);
+			for (int i = 0; i < tab->arr_cnt; i++)
+				arr[i] = forward_value(cpu, c, arr[i]);
+			forward_ptr(tab->shape);
+			forward_ptr(tab->slot);
+			forward_ptr(tab->entry);
+			forward_ptr(tab->group);
+			forward_ptr(tab->arr);
+			refs += tab->entry_top + tab->arr_cnt;
+			break;
+		}
+		case t_func: {
+			struct funcobj* func = (struct funcobj*)obj;
+			int upval_cnt = ((struct code*)readptr(func->code))->upval_cnt;
+			for (int i = 0; i < upval_cnt; i++)
+				forward_ptr(func->upval[i]);
+			forward_ptr(func->code);
+			refs += upval_cnt;
+			break;
+		}
+		case t_upval: {
+			struct upval* upval = (struct upval*)obj;
+			if (readptr(upval->val) == &upval->val_holder)
+				upval->val_holder = forward_value(cpu, c, upval->val_holder);
+			else {
+				forward_ptr(upval->prev);
+				forward_ptr(upval->next);
+			}
+			forward_ptr(upval->val);
+			break;
+		}
+		case t_assetmap: forward_ptr(((struct assetmapobj*)obj)->buf); break;
+		case t_shape: {
+			struct shapeobj* shape = (struct shapeobj*)obj;
+			for (int i = 0; i < shape->key_cnt; i++)
+				forward_ptr(shape->keys[i]);
+			forward_ptr(shape->parent);
+			forward_ptr(shape->child);
+			forward_ptr(shape->sibling);
+			refs += shape->key_cnt;
+			break;
+		}
+		}
+		refs++;
+		obj = next;
+	}
+	/* Strings */
+	forward_strtab(cpu, c, readptr(cpu->strtab), 0, cpu->strtab_size);
+	if (cpu->strtab_old_size)
+		forward_strtab(cpu, c, readptr(cpu->strtab_old), cpu->strtab_rehash, cpu->strtab_old_size);
+	forward_ptr(cpu->strtab);
+	forward_ptr(cpu->strtab_old);
+	refs += cpu->strtab_cnt;
+	/* Code */
+	struct code* codes = (struct code*)readptr_nullable(cpu->code);
+	for (int i = 0; i < cpu->code_cnt; i++) {
+		struct code* code = &codes[i];
+		forward_ptr(code->name);
+		forward_ptr(code->ins);
+		forward_ptr(code->icache);
+		forward_ptr(code->blkcost);
+		forward_ptr(code->lineinfo);
+		forward_ptr(code->k);
+		forward_ptr(code->upval);
+	}
+	forward_ptr(cpu->code);
+	forward_ptr(((struct funcobj*)readptr(cpu->topfunc))->code);
+	forward_ptr(cpu->topfunc);
+	forward_ptr(cpu->curfunc);
+	/* Roots, stale stack slots refer to live objects too */
+	value_t* stack = (value_t*)readptr_nullable(cpu->stack);
+	for (int i = 0; i < cpu->stack_cap; i++)
+		stack[i] = forward_value(cpu, c, stack[i]);
+	forward_ptr(cpu->stack);
+	forward_ptr(cpu->upval_open);
+	forward_ptr(cpu->globals);
+	forward_ptr(cpu->shape_root);
+	forward_ptr(cpu->overlay_state);
+	forward_ptr(cpu->_lit_EMPTY);
+#define X(s) forward_ptr(cpu->_lit_##s);
+	STRLIT_DEF(X)
+#undef X
+	for (int i = 0; i < STRCHR_CNT; i++)
+		forward_ptr(cpu->_chr[i]);
+	return refs;
+}
+
+/* One compaction step, returns 0 when there is nothing left to move */
+static int gc_compact(struct cpu* cpu) {
+	struct compact c;
+	mem_flush_pools(&cpu->alloc);
+	gc_compact_mark(cpu);
+	if (!mem_compact_begin(&cpu->alloc, &c, COMPACT_QUOTA))
+		return 0;
+	int refs = gc_compact_forward(cpu, &c);
+	mem_compact_end(&cpu->alloc, &c);
+	cpu->cycles -= refs * CYCLES_TRAVERSE + CYCLES_VALUES(c.moved / sizeof(value_t));
+	return 1;
+}
+
+static void gc_mark_roots(struct cpu* cpu) {
+	gc_mark_gray(cpu, (struct containerobj*)readptr(cpu->globals));
+	gc_mark_shape(cpu, (struct shapeobj*)readptr(cpu->shape_root));
+	struct containerobj* overlay_state = (struct containerobj*)readptr_nullable(cpu->overlay_state);
+	if (overlay_state)
+		gc_mark_gray(cpu, overlay_state);
+	struct containerobj* curfunc = (struct containerobj*)readptr_nullable(cpu->curfunc);
+	if (curfunc)
+		gc_mark_gray(cpu, curfunc);
+	/* Their values are on the stack */
+	for (struct upval* val = readptr_nullable(cpu->upval_open); val; val = readptr_nullable(val->next))
+		gc_mark_black(cpu, val);
+	/* Registers of the current frame may be stale, they are marked anyway.
+	 * Slots above are cleared, so no slot outlives the object it refers to */
+	value_t* stack = (value_t*)readptr_nullable(cpu->stack);
+	int top = cpu->sp + CPU_FRAME_SIZE;
+	if (top > cpu->stack_cap)
+		top = cpu->stack_cap;
+	for (int i = 0; i < top; i++)
+		mark_value(stack[i]);
+	for (int i = top; i < cpu->stack_cap; i++)
+		stack[i] = value_undef();
+	cpu->cycles -= top * CYCLES_TRAVERSE;
+}
+
+/* Traverse gray objects until cpu->cycles drops below limit, returns 1 when
+ * none is left */
+static int gc_propagate(struct cpu* cpu, int limit) {
+	while (cpu->grayhead) {
+		if (cpu->cycles < limit)
+			return 0;
+		struct containerobj* obj = (struct containerobj*)readptr(cpu->grayhead);
+		check(obj_get_mark(obj) == gm_gray);
+		cpu->grayhead = obj->graylist;
+		gc_traverse_obj(cpu, obj);
+	}
+	return 1;
+}
+
+/* Collect the young objects, all objects are old afterwards */
+static void gc_minor(struct cpu* cpu) {
+	gc_mark_roots(cpu);
+	gc_propagate(cpu, INT_MIN);
+	struct obj* oldhead = readptr_nullable(cpu->oldhead);
+	uint32_t head = make_obj_header(0, 0, readptr_nullable(cpu->gchead));
+	uint32_t* prev = &head;
+	for (struct obj* cur = obj_header_get_gcnext(head); cur != oldhead;) {
+		cpu->cycles -= CYCLES_ALLOC;
+		struct obj* next = obj_get_gcnext(cur);
+		if (obj_get_mark(cur) == gm_white)
+			gc_free(cpu, cur);
+		else {
+			*prev = obj_header_set_gcnext(*prev, cur);
+			prev = &cur->obj_header;
+		}
+		cur = next;
+	}
+	*prev = obj_header_set_gcnext(*prev, oldhead);
+	cpu->gchead = writeptr_nullable((struct obj*)obj_header_get_gcnext(head));
+	cpu->oldhead = cpu->gchead;
+	cpu->minor_base = cpu->alloc.used_memory;
+}
+
+/* Back to minor collections once a major cycle is done */
+static void gc_end_major(struct cpu* cpu) {
+	cpu->gcstate = gs_reset;
+	cpu->oldhead = cpu->gchead;
+	cpu->minor_base = cpu->alloc.used_memory;
+}
+
+/* Where the collector runs */
+#define SAFE_ALLOC	0 /* inside gc_alloc, C code may hold unreachable objects */
+#define SAFE_VM		1 /* between instructions, objects must not move */
+#define SAFE_IDLE	2 /* between frames */
+
+/* Whether work waits for a safepoint */
+static int gc_due(struct cpu* cpu) {
+	switch (cpu->gcstate) {
+	case gs_reset:
+		return cpu->alloc.used_memory >= cpu->major_threshold
+			|| (int32_t)(cpu->alloc.used_memory - cpu->minor_base) >= GC_NURSERY_SIZE;
+	case gs_mark: return !cpu->grayhead;
+	case gs_sweep: return 0;
+	case gs_compact: return (int32_t)(cpu->alloc.used_memory - cpu->minor_base) >= GC_NURSERY_SIZE;
+	}
+	return 0;
+}
+
+/* Collector work until cpu->cycles drops below limit */
+static void gc_run(struct cpu* cpu, int limit, int safepoint) {
 	switch (cpu->gcstate) {
 	case gs_reset: {
+		if (safepoint == SAFE_ALLOC)
+			return;
+		if (cpu->alloc.used_memory < cpu->major_threshold) {
+			if ((int32_t)(cpu->alloc.used_memory - cpu->minor_base) >= GC_NURSERY_SIZE)
+				gc_minor(cpu);
+			return;
+		}
+		gc_minor(cpu);
+		/* Flip white/black bits */
+		cpu->gcwhite = 1 - cpu->gcwhite;
 		cpu->gcstate = gs_mark;
-		/* Mark root set */
-		gc_mark_gray(cpu, (struct containerobj*)readptr(cpu->globals));
-		struct containerobj* overlay_state = (struct containerobj*)readptr_nullable(cpu->overlay_state);
-		if (overlay_state)
-			gc_mark_gray(cpu, overlay_state);
+		cpu->gcdebt = 0;
+		gc_mark_roots(cpu);
 		/* passthrough */
 	}
 	case gs_mark: {
-		while (cpu->grayhead) {
-			if (cpu->cycles < 0)
-				return;
-			struct containerobj* obj = (struct containerobj*)readptr(cpu->grayhead);
-			check(obj_get_mark(obj) == gm_gray);
-			cpu->grayhead = obj->graylist;
-			gc_traverse_obj(cpu, obj);
-		}
+		if (!gc_propagate(cpu, limit) || safepoint == SAFE_ALLOC)
+			return;
+		/* The stack has no write barrier, scan it again */
+		gc_mark_roots(cpu);
+		gc_propagate(cpu, INT_MIN);
 		cpu->gcstate = gs_sweep;
 		/* Move all current objects to sweep list */
 		cpu->sweephead = make_obj_header(0, 0, readptr_nullable(cpu->gchead));
 		cpu->gchead = writeptr_nullable(NULL);
 		cpu->sweepcur = writeptr(&cpu->sweephead);
-		/* Flip white/black bits */
-		cpu->gcwhite = 1 - cpu->gcwhite;
 		/* passthrough */
 	}
 	case gs_sweep: {
 		uint32_t* prev = (uint32_t*)readptr(cpu->sweepcur);
-		int oldwhite = 1 - gm_white;
 		for (struct obj* cur = obj_header_get_gcnext(*prev); cur;) {
-			if (cpu->cycles < 0) {
+			if (cpu->cycles < limit) {
+				/* Skip the objects freed so far */
+				*prev = obj_header_set_gcnext(*prev, cur);
 				cpu->sweepcur = writeptr(prev);
 				return;
 			}
 			cpu->cycles -= CYCLES_ALLOC;
 			struct obj* next = obj_get_gcnext(cur);
 			check(obj_get_mark(cur) != gm_gray);
-			if (obj_get_mark(cur) == oldwhite)
+			if (obj_get_mark(cur) == gm_white)
 				gc_free(cpu, cur);
 			else {
 				*prev = obj_header_set_gcnext(*prev, cur);
@@ -178,8 +507,57 @@ void gc_collect(struct cpu* cpu) {
 		cpu->gchead = writeptr_nullable((struct obj*)obj_header_get_gcnext(cpu->sweephead));
 		cpu->sweephead = 0;
 		cpu->sweepcur = writeptr_nullable(NULL);
-		cpu->gcstate = gs_reset;
+		uint32_t threshold = (uint32_t)((uint64_t)cpu->alloc.used_memory * cpu->gcpause / 100);
+		cpu->major_threshold = threshold < GC_MIN_THRESHOLD ? GC_MIN_THRESHOLD : threshold > GC_MAX_THRESHOLD ? GC_MAX_THRESHOLD : threshold;
+		if (gc_fragmented(cpu))
+			cpu->gcstate = gs_compact;
+		else
+			gc_end_major(cpu);
 		break;
 	}
+	case gs_compact: {
+		/* A long running cart needs minor collections more */
+		if (safepoint == SAFE_VM) {
+			gc_end_major(cpu);
+			break;
+		}
+		/* Every step is complete on its own, the cart runs in between */
+		if (safepoint == SAFE_ALLOC || cpu->cycles < limit)
+			return;
+		if (!gc_compact(cpu) || !gc_fragmented(cpu))
+			gc_end_major(cpu);
+		break;
+	}
+	}
+}
+
+/* Give back the cycles taken by a request */
+static void gc_release(struct cpu* cpu) {
+	if (cpu->gcrequest) {
+		cpu->cycles += cpu->gcheld;
+		cpu->gcrequest = 0;
+	}
+}
+
+/* Pay off the allocation debt */
+void gc_step(struct cpu* cpu) {
+	int work = (int)(cpu->gcdebt / sizeof(value_t)) * cpu->gcstepmul / 100;
+	cpu->gcdebt = 0;
+	gc_run(cpu, cpu->cycles - work, SAFE_ALLOC);
+	if (!cpu->gcrequest && gc_due(cpu)) {
+		cpu->gcrequest = 1;
+		cpu->gcheld = cpu->cycles;
+		cpu->cycles = 0;
 	}
 }
+
+/* Only the work which was due, the cart keeps its cycles */
+void gc_safepoint(struct cpu* cpu) {
+	gc_release(cpu);
+	gc_run(cpu, cpu->cycles, SAFE_VM);
+}
+
+void gc_collect(struct cpu* cpu) {
+	gc_release(cpu);
+	gc_run(cpu, 0, SAFE_IDLE);
+}
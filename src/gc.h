@@ -3,6 +3,18 @@
 
 #include "cpu.h"
 
+/* Memory allocated between minor collections */
+#define GC_NURSERY_SIZE		(CPU_MEM_SIZE / 16)
+/* The next major cycle starts when used memory grows to gcpause percent
+ * of what the last one left, within the threshold bounds */
+#define GC_PAUSE			200
+#define GC_MIN_THRESHOLD	(CPU_MEM_SIZE / 4)
+#define GC_MAX_THRESHOLD	(CPU_MEM_SIZE * 3 / 4)
+/* While a major cycle runs, every GC_STEP_SIZE bytes allocated pay for
+ * gcstepmul percent cycles of collector work per allocated value */
+#define GC_STEPMUL			200
+#define GC_STEP_SIZE		1024
+
 #define gc_barrier(cpu, container, value) do { \
 		value_t _value = (value); \
 		struct containerobj* _container = (struct containerobj*)(container); \
@@ -26,9 +38,17 @@
 			} \
 		} \
 	} while (0)
+/* Tables moving to another shape */
+#define gc_barrier_shape(cpu, container, shape) do { \
+		if (obj_get_mark((struct containerobj*)(container)) == gm_black) \
+			gc_mark_shape(cpu, shape); \
+	} while (0)
 
 struct obj* gc_alloc(struct cpu* cpu, enum type type, uint32_t size);
+void gc_step(struct cpu* cpu);
+void gc_safepoint(struct cpu* cpu);
 void gc_mark_value(struct cpu* cpu, value_t value);
+void gc_mark_shape(struct cpu* cpu, struct shapeobj* shape);
 void gc_collect(struct cpu* cpu);
 
 #endif
@@ -97,20 +97,27 @@ void key_input(char ch) {
 		io->input[io->input_size++] = ch;
 }
 
-enum key key_translate(struct cpu* cpu, struct strobj* key) {
-	if (key->len == 1) {
-		for (int i = 0; i < kc_cnt; i++)
-			if (key_char[i] == key->data[0])
+int key_find(const char* name, int len) {
+	if (len == 1) {
+		for (int i = 0; i < kc__end; i++)
+			if (key_char[i] == name[0])
 				return i;
 	}
 	else {
-		for (int i = 0; i < kc_cnt; i++) {
-			int len = (int)strlen(key_name[i]);
-			if (str_equal(key->data, key->len, key_name[i], len))
+		for (int i = 0; i < kc__end; i++) {
+			int keylen = (int)strlen(key_name[i]);
+			if (str_equal(name, len, key_name[i], keylen))
 				return i;
 		}
 	}
-	runtime_error(cpu, "Unknown key name.");
+	return -1;
+}
+
+enum key key_translate(struct cpu* cpu, struct strobj* key) {
+	int ret = key_find(key->data, key->len);
+	if (ret == -1)
+		runtime_error(cpu, "Unknown key name.");
+	return ret;
 }
 
 int btn_translate(struct cpu* cpu, struct strobj* key) {
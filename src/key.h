@@ -127,6 +127,7 @@ void key_press(enum key key);
 void key_release(enum key key);
 void key_setstate(enum key key, int pressed);
 void key_input(char ch);
+int key_find(const char* name, int len);
 enum key key_translate(struct cpu* cpu, struct strobj* key);
 int btn_translate(struct cpu* cpu, struct strobj* key);
 void btn_standard_update();
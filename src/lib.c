@@ -6,6 +6,7 @@
 #include "platform.h"
 #include "rand.h"
 #include "str.h"
+#include "strbuf.h"
 #include "tab.h"
 
 #include <stdlib.h>
@@ -308,6 +309,27 @@ value_t lib_statMem(struct cpu* cpu, int sp, int nargs) {
 	return value_num(usage);
 }
 
+/* gcTune(pause, stepmul): major cycle pause and allocation step multiplier, in percent */
+value_t lib_gcTune(struct cpu* cpu, int sp, int nargs) {
+	if (nargs != 2)
+		argument_error(cpu);
+	int pause = num_int(to_number(cpu, ARG(0)));
+	int stepmul = num_int(to_number(cpu, ARG(1)));
+	if (pause < 100 || stepmul < 1)
+		runtime_error(cpu, "Invalid number.");
+	cpu->gcpause = pause;
+	cpu->gcstepmul = stepmul;
+	return value_undef();
+}
+
+value_t lib_strbuf(struct cpu* cpu, int sp, int nargs) {
+	struct strbufobj* sb = strbuf_new(cpu);
+	cpu->cycles -= CYCLES_ALLOC;
+	for (int i = 0; i < nargs; i++)
+		strbuf_append_value(cpu, sb, ARG(i));
+	return value_strbuf(sb);
+}
+
 value_t devlib_key(struct cpu* cpu, int sp, int nargs) {
 	if (nargs != 1)
 		argument_error(cpu);
@@ -329,8 +351,8 @@ value_t devlib_mpos(struct cpu* cpu, int sp, int nargs) {
 		argument_error(cpu);
 	struct tabobj* tab = tab_new(cpu);
 	struct io* io = console_getio();
-	tab_set(cpu, tab, str_intern(cpu, "x", 1), value_num(io->mousex));
-	tab_set(cpu, tab, str_intern(cpu, "y", 1), value_num(io->mousey));
+	tab_set(cpu, tab, str_char(cpu, "x"), value_num(io->mousex));
+	tab_set(cpu, tab, str_char(cpu, "y"), value_num(io->mousey));
 	cpu->cycles -= CYCLES_ALLOC + CYCLES_LOOKUP * 2;
 	return value_tab(tab);
 }
@@ -709,6 +731,8 @@ static const struct libdef libdefs[] = {
 	{"rand", cf_lib_rand },
 	{"statCpu", cf_lib_statCpu },
 	{"statMem", cf_lib_statMem },
+	{"gcTune", cf_lib_gcTune },
+	{"strbuf", cf_lib_strbuf },
 	{ NULL, 0 },
 };
 
@@ -0,0 +1,623 @@
+#include "alloc.h"
+#include "opt.h"
+
+#include <string.h>
+
+/* Peephole pass
+ * Runs over a function once it is compiled, before its inline caches and
+ * block costs are sized. The compiler evaluates every expression into a
+ * fresh temporary and then moves it into place, most of the work is folding
+ * those moves back into the instruction that computed the value. Rewrites
+ * that drop a register write need the register to be dead, which comes from
+ * a backward liveness pass over the instructions. A register captured by a
+ * closure is read through the upvalue while it is open, so calls, closes
+ * and returns read the registers that may have an open upvalue. Each round
+ * marks the instructions to remove, then compacts them out and fixes the
+ * jump offsets and the line info.
+ */
+
+#define OPT_ROUNDS		4
+#define OPT_THREAD		16
+#define OPT_COALESCE	64
+
+/* operand roles */
+#define R_DEF1			1	/* op1 is written */
+#define R_USE1			2
+#define R_USE2			4
+#define R_USE3			8
+#define R_PURE			16	/* writing op1 is the only effect */
+#define R_RANGE			32	/* reads or writes more registers, see ins_regs */
+#define R_JUMP			64	/* imm is a jump offset */
+#define R_COND			128	/* jump that can fall through */
+#define R_CJUMP			256	/* compare and branch, followed by a jump */
+#define R_END			512
+
+/* instruction flags */
+#define F_WORD			1	/* jump offset word of a compare and branch */
+#define F_TARGET		2
+#define F_REACHED		4
+#define F_GONE			8
+
+struct opt {
+	struct cpu* cpu;
+	struct code* code;
+	struct ins* ins;
+	int cnt;
+	int words; /* register set size in words */
+	uint32_t* live; /* registers live into each instruction */
+	uint32_t* open; /* registers with a possibly open upvalue before each instruction */
+	uint32_t* pinned; /* registers that are always live */
+	uint32_t* tmp;
+	uint8_t* flag;
+	int* work;
+};
+
+#define reg_set(set, r)		((set)[(r) >> 5] |= 1u << ((r) & 31))
+#define reg_has(set, r)		(((set)[(r) >> 5] >> ((r) & 31)) & 1)
+
+static int ins_roles(uint8_t opcode) {
+	switch (opcode) {
+	case op_kundef: case op_knull: case op_kfalse: case op_ktrue: case op_knum: case op_kstr:
+	case op_gget: case op_uget:
+		return R_DEF1 | R_PURE;
+	case op_mov:
+		return R_DEF1 | R_USE2 | R_PURE;
+	case op_arr: case op_tab: case op_func:
+		return R_DEF1;
+	case op_inc: case op_dec: case op_plus: case op_neg: case op_not: case op_bnot: case op_typeof:
+	case op_addrn: case op_subrn: case op_mulrn: case op_divrn: case op_modrn: case op_powrn:
+	case op_bandrn: case op_borrn: case op_bxorrn: case op_shlrn: case op_shrrn: case op_ushrrn:
+	case op_eqrn: case op_nern: case op_ltrn: case op_lern: case op_gtrn: case op_gern:
+	case op_fgets: case op_fgetn:
+		return R_DEF1 | R_USE2;
+	case op_addnr: case op_subnr: case op_mulnr: case op_divnr: case op_modnr: case op_pownr:
+	case op_bandnr: case op_bornr: case op_bxornr: case op_shlnr: case op_shrnr: case op_ushrnr:
+	case op_eqnr: case op_nenr: case op_ltnr: case op_lenr: case op_gtnr: case op_genr:
+		return R_DEF1 | R_USE3;
+	case op_add: case op_sub: case op_mul: case op_div: case op_mod: case op_pow:
+	case op_band: case op_bor: case op_bxor: case op_shl: case op_shr: case op_ushr:
+	case op_eq: case op_ne: case op_lt: case op_le: case op_gt: case op_ge:
+	case op_in: case op_fget: case op_fdel:
+		return R_DEF1 | R_USE2 | R_USE3;
+	case op_fset:
+		return R_USE1 | R_USE2 | R_USE3;
+	case op_fsets: case op_fsetn:
+		return R_USE1 | R_USE3;
+	case op_apush:
+		return R_USE1 | R_USE2;
+	case op_gset:
+		return R_USE1;
+	case op_uset:
+		return R_USE2;
+	case op_j: case op_closej:
+		return R_JUMP;
+	case op_jtrue: case op_jfalse:
+		return R_USE1 | R_JUMP | R_COND;
+	case op_jlt: case op_jge: case op_jeq: case op_jne:
+		return R_USE1 | R_USE2 | R_CJUMP;
+	case op_jltrn: case op_jgern: case op_jeqrn: case op_jnern:
+		return R_USE1 | R_CJUMP;
+	case op_jltnr: case op_jgenr:
+		return R_USE2 | R_CJUMP;
+	case op_ret:
+		return R_USE1 | R_END;
+	case op_retu:
+		return R_END;
+	case op_close:
+		return 0;
+	default: /* xchg, iter, next, call */
+		return R_RANGE;
+	}
+}
+
+static void ins_regs(struct ins* ins, uint32_t* use, uint32_t* def) {
+	int roles = ins_roles(ins->opcode);
+	if (roles & R_USE1)
+		reg_set(use, ins->op1);
+	if (roles & R_USE2)
+		reg_set(use, ins->op2);
+	if (roles & R_USE3)
+		reg_set(use, ins->op3);
+	if (roles & R_DEF1)
+		reg_set(def, ins->op1);
+	if (!(roles & R_RANGE))
+		return;
+	switch (ins->opcode) {
+	case op_xchg:
+		reg_set(use, ins->op1);
+		reg_set(use, ins->op2);
+		reg_set(def, ins->op1);
+		reg_set(def, ins->op2);
+		break;
+	case op_iter:
+		reg_set(use, ins->op2);
+		reg_set(def, ins->op1);
+		reg_set(def, ins->op1 + 1);
+		break;
+	case op_next:
+		reg_set(use, ins->op3);
+		reg_set(use, ins->op3 + 1);
+		reg_set(def, ins->op1);
+		reg_set(def, ins->op2);
+		break;
+	case op_call:
+		/* function, this and arguments, the callee frame above is not
+		 * known and left alone */
+		for (int r = ins->op1; r <= ins->op1 + 1 + ins->op2; r++)
+			reg_set(use, r);
+		reg_set(def, ins->op1);
+		break;
+	}
+}
+
+/* highest register an instruction touches */
+static int ins_maxreg(struct ins* ins) {
+	int roles = ins_roles(ins->opcode);
+	int r = 0;
+	if (roles & (R_USE1 | R_DEF1))
+		r = ins->op1;
+	if ((roles & R_USE2) && ins->op2 > r)
+		r = ins->op2;
+	if ((roles & R_USE3) && ins->op3 > r)
+		r = ins->op3;
+	switch (ins->opcode) {
+	case op_xchg: return ins->op1 > ins->op2 ? ins->op1 : ins->op2;
+	case op_iter: return ins->op1 + 1 > ins->op2 ? ins->op1 + 1 : ins->op2;
+	case op_next: r = ins->op1 > ins->op2 ? ins->op1 : ins->op2; return ins->op3 + 1 > r ? ins->op3 + 1 : r;
+	case op_call: return ins->op1 + 1 + ins->op2;
+	default: return r;
+	}
+}
+
+static int jump_target(struct ins* ins, int pc) {
+	return pc + 1 + ins[pc].imm;
+}
+
+/* Successors of pc, a compare and branch goes through its jump word */
+static int successors(struct opt* o, int pc, int* succ) {
+	int roles = ins_roles(o->ins[pc].opcode);
+	int n = 0;
+	if (roles & R_END)
+		return 0;
+	if (roles & R_JUMP) {
+		succ[n++] = jump_target(o->ins, pc);
+		if (roles & R_COND)
+			succ[n++] = pc + 1;
+	}
+	else if (roles & R_CJUMP) {
+		succ[n++] = pc + 1;
+		succ[n++] = pc + 2;
+	}
+	else
+		succ[n++] = pc + 1;
+	return n;
+}
+
+static void live_out(struct opt* o, int pc, uint32_t* out) {
+	int succ[2];
+	int n = successors(o, pc, succ);
+	memcpy(out, o->pinned, o->words * sizeof(uint32_t));
+	for (int i = 0; i < n; i++) {
+		if (succ[i] >= o->cnt)
+			continue;
+		uint32_t* in = &o->live[succ[i] * o->words];
+		for (int w = 0; w < o->words; w++)
+			out[w] |= in[w];
+	}
+}
+
+/* Registers a closure created by op_func captures from the frame */
+static void func_captures(struct opt* o, int code_id, uint32_t* set) {
+	struct cpu* cpu = o->cpu;
+	struct code* code = &((struct code*)readptr(cpu->code))[code_id];
+	struct updef* defs = (struct updef*)readptr_nullable(code->upval);
+	for (int i = 0; i < code->upval_cnt; i++) {
+		if (defs[i].in_stack && defs[i].idx < o->words * 32)
+			reg_set(set, defs[i].idx);
+	}
+}
+
+/* Bits of set word w for the registers from r up */
+static uint32_t reg_mask_from(int r, int w) {
+	if (w * 32 >= r)
+		return ~0u;
+	if (w * 32 + 32 <= r)
+		return 0;
+	return ~((1u << (r - w * 32)) - 1);
+}
+
+static void open_upvals(struct opt* o) {
+	int words = o->words;
+	uint32_t* out = o->tmp;
+	memset(o->open, 0, o->cnt * words * sizeof(uint32_t));
+	int changed;
+	do {
+		changed = 0;
+		for (int pc = 0; pc < o->cnt; pc++) {
+			if (o->flag[pc] & F_GONE)
+				continue;
+			struct ins* ins = &o->ins[pc];
+			memcpy(out, &o->open[pc * words], words * sizeof(uint32_t));
+			if (ins->opcode == op_func)
+				func_captures(o, ins->imm, out);
+			else if (ins->opcode == op_close || ins->opcode == op_closej) {
+				for (int w = 0; w < words; w++)
+					out[w] &= ~reg_mask_from(ins->op1, w);
+			}
+			int succ[2];
+			int n = successors(o, pc, succ);
+			for (int i = 0; i < n; i++) {
+				if (succ[i] >= o->cnt)
+					continue;
+				uint32_t* in = &o->open[succ[i] * words];
+				for (int w = 0; w < words; w++) {
+					if (out[w] & ~in[w]) {
+						in[w] |= out[w];
+						changed = 1;
+					}
+				}
+			}
+		}
+	} while (changed);
+}
+
+static void liveness(struct opt* o) {
+	int words = o->words;
+	uint32_t* out = o->tmp;
+	uint32_t* use = o->tmp + words;
+	uint32_t* def = o->tmp + words * 2;
+	memset(o->live, 0, o->cnt * words * sizeof(uint32_t));
+	int changed;
+	do {
+		changed = 0;
+		for (int pc = o->cnt - 1; pc >= 0; pc--) {
+			if (o->flag[pc] & F_GONE)
+				continue;
+			live_out(o, pc, out);
+			memset(use, 0, words * 2 * sizeof(uint32_t));
+			struct ins* ins = &o->ins[pc];
+			ins_regs(ins, use, def);
+			if (ins->opcode == op_call || ins->opcode == op_ret || ins->opcode == op_retu ||
+				ins->opcode == op_close || ins->opcode == op_closej) {
+				int from = ins->opcode == op_close || ins->opcode == op_closej ? ins->op1 : 0;
+				uint32_t* open = &o->open[pc * words];
+				for (int w = 0; w < words; w++)
+					use[w] |= open[w] & reg_mask_from(from, w);
+			}
+			uint32_t* in = &o->live[pc * words];
+			for (int w = 0; w < words; w++) {
+				uint32_t v = use[w] | (out[w] & ~def[w]);
+				if (v != in[w]) {
+					in[w] = v;
+					changed = 1;
+				}
+			}
+		}
+	} while (changed);
+}
+
+/* Register r holds no value used after pc */
+static int dead_after(struct opt* o, int pc, int r) {
+	struct ins* ins = &o->ins[pc];
+	if ((ins_roles(ins->opcode) & R_DEF1) && ins->op1 == r && !reg_has(o->pinned, r))
+		return 1;
+	live_out(o, pc, o->tmp);
+	return !reg_has(o->tmp, r);
+}
+
+/* Points jumps past chains of unconditional jumps, jump words included as
+ * they run as a plain jump when jumped to */
+static int thread_jumps(struct opt* o) {
+	int changed = 0;
+	for (int pc = 0; pc < o->cnt; pc++) {
+		if (!(ins_roles(o->ins[pc].opcode) & R_JUMP))
+			continue;
+		int target = jump_target(o->ins, pc);
+		for (int i = 0; i < OPT_THREAD && target < o->cnt && o->ins[target].opcode == op_j; i++) {
+			int next = jump_target(o->ins, target);
+			if (next == target)
+				break;
+			target = next;
+		}
+		int imm = target - pc - 1;
+		if (imm != o->ins[pc].imm && imm >= INT16_MIN && imm <= INT16_MAX) {
+			o->ins[pc].imm = (int16_t)imm;
+			changed = 1;
+		}
+	}
+	return changed;
+}
+
+/* Marks jump words and jump targets, instructions that cannot be reached
+ * are gone */
+static void scan(struct opt* o) {
+	if (o->cnt > 0)
+		memset(o->flag, 0, (size_t)o->cnt);
+	for (int pc = 0; pc + 1 < o->cnt; pc++) {
+		if (ins_roles(o->ins[pc].opcode) & R_CJUMP)
+			o->flag[++pc] |= F_WORD;
+	}
+	int top = 0;
+	o->work[top++] = 0;
+	o->flag[0] |= F_REACHED;
+	while (top) {
+		int pc = o->work[--top];
+		int succ[2];
+		int n = successors(o, pc, succ);
+		if (ins_roles(o->ins[pc].opcode) & R_JUMP)
+			o->flag[succ[0]] |= F_TARGET;
+		for (int i = 0; i < n; i++) {
+			if (succ[i] < o->cnt && !(o->flag[succ[i]] & F_REACHED)) {
+				o->flag[succ[i]] |= F_REACHED;
+				o->work[top++] = succ[i];
+			}
+		}
+	}
+	for (int pc = 0; pc < o->cnt; pc++) {
+		if (!(o->flag[pc] & F_REACHED))
+			o->flag[pc] |= F_GONE;
+	}
+}
+
+static const uint8_t fold_ops[][3] = {
+	{ op_add, op_addrn, op_addnr },
+	{ op_sub, op_subrn, op_subnr },
+	{ op_mul, op_mulrn, op_mulnr },
+	{ op_div, op_divrn, op_divnr },
+	{ op_mod, op_modrn, op_modnr },
+	{ op_pow, op_powrn, op_pownr },
+	{ op_band, op_bandrn, op_bandnr },
+	{ op_bor, op_borrn, op_bornr },
+	{ op_bxor, op_bxorrn, op_bxornr },
+	{ op_shl, op_shlrn, op_shlnr },
+	{ op_shr, op_shrrn, op_shrnr },
+	{ op_ushr, op_ushrrn, op_ushrnr },
+	{ op_eq, op_eqrn, op_eqnr },
+	{ op_ne, op_nern, op_nenr },
+	{ op_lt, op_ltrn, op_ltnr },
+	{ op_le, op_lern, op_lenr },
+	{ op_gt, op_gtrn, op_gtnr },
+	{ op_ge, op_gern, op_genr },
+	{ op_jlt, op_jltrn, op_jltnr },
+	{ op_jge, op_jgern, op_jgenr },
+	{ op_jeq, op_jeqrn, op_jeqrn },
+	{ op_jne, op_jnern, op_jnern },
+};
+
+/* Turns "knum t, k; op d, a, t" into "op d, a, k" */
+static int fold_knum(struct ins* k, struct ins* ins) {
+	uint16_t slot = (uint16_t)k->imm;
+	if (slot > MAX_KOP)
+		return 0;
+	for (int i = 0; i < (int)(sizeof(fold_ops) / sizeof(fold_ops[0])); i++) {
+		if (ins->opcode != fold_ops[i][0])
+			continue;
+		int cjump = ins_roles(ins->opcode) & R_CJUMP;
+		uint8_t* l = cjump ? &ins->op1 : &ins->op2;
+		uint8_t* r = cjump ? &ins->op2 : &ins->op3;
+		if (*r == k->op1 && *l != k->op1) {
+			ins->opcode = fold_ops[i][1];
+			*r = (uint8_t)slot;
+		}
+		else if (*l == k->op1 && *r != k->op1) {
+			ins->opcode = fold_ops[i][2];
+			if (ins->opcode == op_jeqrn || ins->opcode == op_jnern) {
+				/* equality is symmetric, the constant goes right */
+				*l = *r;
+				*r = (uint8_t)slot;
+			}
+			else
+				*l = (uint8_t)slot;
+		}
+		else
+			return 0;
+		return 1;
+	}
+	return 0;
+}
+
+/* Reads register from in an instruction as register to */
+static int rename_use(struct ins* ins, int from, int to) {
+	int roles = ins_roles(ins->opcode);
+	if (roles & R_RANGE)
+		return 0;
+	int n = 0;
+	if ((roles & R_USE1) && ins->op1 == from)
+		ins->op1 = (uint8_t)to, n++;
+	if ((roles & R_USE2) && ins->op2 == from)
+		ins->op2 = (uint8_t)to, n++;
+	if ((roles & R_USE3) && ins->op3 == from)
+		ins->op3 = (uint8_t)to, n++;
+	return n;
+}
+
+/* Renames the temporary a "mov d, t" copies to d, from the instruction
+ * computing t on. The instructions in between must run straight through
+ * and leave d alone, so d can hold the value early. */
+static int coalesce(struct opt* o, int pc) {
+	struct ins* mov = &o->ins[pc];
+	int d = mov->op1, t = mov->op2;
+	if (d == t || (o->flag[pc] & F_TARGET) || !dead_after(o, pc, t))
+		return 0;
+	int words = o->words;
+	uint32_t* use = o->tmp + words;
+	uint32_t* def = o->tmp + words * 2;
+	int q = pc - 1;
+	for (int n = 0; ; q--, n++) {
+		if (q < 0 || n == OPT_COALESCE)
+			return 0;
+		if (o->flag[q] & F_GONE)
+			continue;
+		struct ins* ins = &o->ins[q];
+		int roles = ins_roles(ins->opcode);
+		if ((o->flag[q] & F_WORD) || (roles & (R_JUMP | R_CJUMP | R_END)))
+			return 0;
+		uint32_t* open = &o->open[q * words];
+		if (reg_has(open, d) || reg_has(open, t))
+			return 0;
+		/* a callee frame starts at the call register */
+		if (ins->opcode == op_call && d >= ins->op1)
+			return 0;
+		memset(use, 0, words * 2 * sizeof(uint32_t));
+		ins_regs(ins, use, def);
+		if (reg_has(use, d) || reg_has(def, d))
+			return 0;
+		if (reg_has(def, t)) {
+			if ((roles & R_RANGE) || reg_has(use, t))
+				return 0;
+			break;
+		}
+		if (reg_has(use, t) && (roles & R_RANGE))
+			return 0;
+		if (o->flag[q] & F_TARGET)
+			return 0;
+	}
+	o->ins[q].op1 = (uint8_t)d;
+	for (int i = q + 1; i < pc; i++) {
+		if (!(o->flag[i] & F_GONE))
+			rename_use(&o->ins[i], t, d);
+	}
+	return 1;
+}
+
+static int rewrite(struct opt* o) {
+	int changed = 0;
+	for (int pc = 0; pc < o->cnt; pc++) {
+		if (o->flag[pc] & (F_GONE | F_WORD))
+			continue;
+		struct ins* ins = &o->ins[pc];
+		int roles = ins_roles(ins->opcode);
+		/* jumps to the next instruction */
+		if ((ins->opcode == op_j || ins->opcode == op_jtrue || ins->opcode == op_jfalse) && ins->imm == 0) {
+			o->flag[pc] |= F_GONE;
+			changed = 1;
+			continue;
+		}
+		/* writes nobody reads */
+		if (roles & R_PURE) {
+			live_out(o, pc, o->tmp);
+			if ((ins->opcode == op_mov && ins->op1 == ins->op2) || !reg_has(o->tmp, ins->op1)) {
+				o->flag[pc] |= F_GONE;
+				changed = 1;
+				continue;
+			}
+		}
+		/* "op t, ...; ...; mov d, t" computes into d */
+		if (ins->opcode == op_mov && coalesce(o, pc)) {
+			o->flag[pc] |= F_GONE;
+			changed = 1;
+			continue;
+		}
+		/* the rest pairs the instruction with the next one, which must not
+		 * be entered from elsewhere */
+		int npc = pc + 1;
+		if (npc >= o->cnt || (o->flag[npc] & (F_GONE | F_WORD | F_TARGET)))
+			continue;
+		struct ins* next = &o->ins[npc];
+		/* "knum t, k; op d, a, t" uses the constant operand form */
+		if (ins->opcode == op_knum && dead_after(o, npc, ins->op1) && fold_knum(ins, next)) {
+			o->flag[pc] |= F_GONE;
+			changed = 1;
+			continue;
+		}
+		/* "mov t, a; op d, t" reads a */
+		if (ins->opcode == op_mov && ins->op1 != ins->op2 && dead_after(o, npc, ins->op1) &&
+			rename_use(next, ins->op1, ins->op2)) {
+			o->flag[pc] |= F_GONE;
+			changed = 1;
+			continue;
+		}
+	}
+	return changed;
+}
+
+/* Drops the gone instructions, then fixes jump offsets and line info */
+static void compact(struct opt* o) {
+	int* map = o->work;
+	int cnt = 0;
+	for (int pc = 0; pc < o->cnt; pc++) {
+		map[pc] = cnt;
+		if (!(o->flag[pc] & F_GONE))
+			cnt++;
+	}
+	map[o->cnt] = cnt;
+	for (int pc = 0; pc < o->cnt; pc++) {
+		if (o->flag[pc] & F_GONE)
+			continue;
+		struct ins ins = o->ins[pc];
+		if (ins_roles(ins.opcode) & R_JUMP) {
+			int target = jump_target(o->ins, pc);
+			ins.imm = (int16_t)(map[target] - map[pc] - 1);
+		}
+		o->ins[map[pc]] = ins;
+	}
+	struct code* code = o->code;
+	struct cpu* cpu = o->cpu;
+	struct licmd* lineinfo = (struct licmd*)readptr_nullable(code->lineinfo);
+	int ins_id = 0, n = 0;
+	for (int i = 0; i < code->lineinfo_cnt; i++) {
+		struct licmd cmd = lineinfo[i];
+		if (cmd.type == li_ins) {
+			int from = ins_id;
+			ins_id += cmd.delta;
+			cmd.delta = map[ins_id < o->cnt ? ins_id : o->cnt] - map[from < o->cnt ? from : o->cnt];
+			if (cmd.delta == 0)
+				continue;
+		}
+		lineinfo[n++] = cmd;
+	}
+	code->lineinfo_cnt = n;
+	code->ins_cnt = cnt;
+	o->cnt = cnt;
+}
+
+void opt_code(struct cpu* cpu, int code_id) {
+	struct code* codes = (struct code*)readptr(cpu->code);
+	struct code* code = &codes[code_id];
+	if (code->ins_cnt == 0)
+		return;
+	struct opt o;
+	o.cpu = cpu;
+	o.code = code;
+	o.ins = (struct ins*)readptr(code->ins);
+	o.cnt = code->ins_cnt;
+	/* register sets only cover the registers the function uses */
+	int maxreg = 3 + code->nargs;
+	for (int pc = 0; pc < o.cnt; pc++) {
+		int r = ins_maxreg(&o.ins[pc]);
+		if (r > maxreg)
+			maxreg = r;
+	}
+	o.words = maxreg / 32 + 1;
+	uint32_t* sets = (uint32_t*)mem_alloc(&cpu->alloc, (o.cnt * 2 + 4) * o.words * sizeof(uint32_t));
+	uint8_t* flag = (uint8_t*)mem_alloc(&cpu->alloc, o.cnt);
+	int* work = (int*)mem_alloc(&cpu->alloc, (o.cnt + 1) * sizeof(int));
+	if (sets && flag && work) {
+		o.live = sets;
+		o.open = sets + o.cnt * o.words;
+		o.pinned = o.open + o.cnt * o.words;
+		o.tmp = o.pinned + o.words;
+		o.flag = flag;
+		o.work = work;
+		/* the frame header and arguments */
+		memset(o.pinned, 0, o.words * sizeof(uint32_t));
+		for (int r = 0; r < 4 + code->nargs && r <= maxreg; r++)
+			reg_set(o.pinned, r);
+		for (int round = 0; round < OPT_ROUNDS; round++) {
+			int changed = thread_jumps(&o);
+			scan(&o);
+			open_upvals(&o);
+			liveness(&o);
+			changed |= rewrite(&o);
+			compact(&o);
+			if (!changed)
+				break;
+		}
+	}
+	if (work)
+		mem_dealloc(&cpu->alloc, work);
+	if (flag)
+		mem_dealloc(&cpu->alloc, flag);
+	if (sets)
+		mem_dealloc(&cpu->alloc, sets);
+}
@@ -0,0 +1,8 @@
+#ifndef _OPT_H
+#define _OPT_H
+
+#include "cpu.h"
+
+void opt_code(struct cpu* cpu, int code_id);
+
+#endif
@@ -484,13 +484,42 @@ struct run_result console_run(const struct cart* cart) {
 		return ret;
 	}
 
-	/* Compile cart code */
-	struct compile_err err = compile(cpu, cart->code, cart->codelen);
-	if (err.msg != NULL) {
-		ret.err = err.msg;
-		ret.linenum = err.linenum;
-		cpu_destroy(cpu);
-		return ret;
+	/* Load the compiled code from the cache, or compile and cache it */
+	uint32_t hash = str_hash(cart->code, cart->codelen);
+	char cache_path[] = CODE_CACHE_PATH;
+	*strchr(cache_path, 'X') = "0123456789abcdef"[hash & 15];
+	uint32_t cache_size;
+	int cached = 0;
+	void* f = platform_open(cache_path, &cache_size);
+	if (f) {
+		cached = compile_load(cpu, cart->code, cart->codelen, hash, f);
+		platform_close(f);
+		/* start over from a clean cpu */
+		if (!cached) {
+			cpu_destroy(cpu);
+			cpu = cpu_new(slot);
+			if (cpu == NULL) {
+				ret.err = "Out of memory.";
+				return ret;
+			}
+		}
+	}
+	if (!cached) {
+		struct compile_err err = compile(cpu, cart->code, cart->codelen);
+		if (err.msg != NULL) {
+			ret.err = err.msg;
+			ret.linenum = err.linenum;
+			cpu_destroy(cpu);
+			return ret;
+		}
+		/* leave the old file alone when the code cannot be saved */
+		if (compile_save(cpu, cart->code, cart->codelen, hash, NULL)) {
+			f = platform_create(cache_path);
+			if (f) {
+				compile_save(cpu, cart->code, cart->codelen, hash, f);
+				platform_close(f);
+			}
+		}
 	}
 
 #ifdef _DEBUG
@@ -649,6 +678,12 @@ int console_getpid() {
 	return g_cur_cpu;
 }
 
+struct cpu* console_getcpu() {
+	if (g_overlay_mode != overlay_inactive)
+		return g_cpus[0];
+	return g_cpus[g_cur_cpu];
+}
+
 void console_kill(int pid) {
 	if (pid == 0)
 		return;
@@ -5,6 +5,8 @@
 
 #define FIRMWARE_PATH "_firm/firmware.cox"
 #define STATE_PATH "_firm/coxstate"
+/* X is replaced by a hex digit of the source hash */
+#define CODE_CACHE_PATH "_firm/codeX.cxc"
 
 #define SEPARATOR_MAGIC		"\n\t"
 #define SPRITESHEET_MAGIC	">sprites"
@@ -82,6 +84,7 @@ struct gfx* console_getgfx();
 struct gfx* console_getgfx_pid(int pid);
 struct gfx* console_getgfx_overlay();
 int console_getpid();
+struct cpu* console_getcpu();
 void console_kill(int pid);
 struct io* console_getio();
 int console_getpixel(int x, int y);
@@ -0,0 +1,282 @@
+/* Headless runner for benchmarking and regression testing.
+ *
+ * Runs a cart through the regular console_run/console_update path without
+ * any window or audio, feeding scripted input, and writes one CSV row per
+ * frame to stdout:
+ *
+ *   frame,cycles,delayed_frames,used_memory,wall_us
+ *
+ * A summary line is written to stderr when the run ends. The cart under test
+ * takes the place of the firmware, so it runs as CPU 0.
+ *
+ * Input script format, one event per line:
+ *
+ *   <frame> +<key>     press key at the start of frame
+ *   <frame> -<key>     release key at the start of frame
+ *   # comment
+ *
+ * Key names are the ones accepted by key() in carts ("a", "left", "space"...).
+ *
+ * With -p the opcode profiler is enabled for the whole run and its CSV
+ * report (see profile.h) is written to the given file at exit.
+ */
+
+#include "../cpu.h"
+#include "../key.h"
+#include "../platform.h"
+#include "../profile.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+extern uint32_t palette[16];
+
+#define DEFAULT_FRAMES	600
+#define DEFAULT_SEED	0x12345678
+
+struct input_event {
+	int frame;
+	int key;
+	int pressed;
+};
+
+static const char* g_cart_path;
+static uint32_t g_seed = DEFAULT_SEED;
+static struct input_event* g_events;
+static int g_event_cnt;
+
+NORETURN void platform_error(const char* msg) {
+	fprintf(stderr, "%s\n", msg);
+	platform_exit(1);
+}
+
+NORETURN void platform_exit(int code) {
+	exit(code);
+}
+
+void* platform_malloc(int size) {
+	return malloc(size);
+}
+
+void platform_free(void* ptr) {
+	free(ptr);
+}
+
+void platform_copy(const char* ptr, int len) {
+}
+
+int platform_paste(char* ptr, int len) {
+	return 0;
+}
+
+uint32_t platform_seed() {
+	return g_seed;
+}
+
+void* platform_open(const char* filename, uint32_t* filesize) {
+	/* The firmware slot is occupied by the cart under test */
+	FILE* f = fopen(filename == NULL ? g_cart_path : filename, "rb");
+	if (f == NULL)
+		return NULL;
+	if (fseek(f, 0, SEEK_END) != 0) {
+		fclose(f);
+		return NULL;
+	}
+	long size = ftell(f);
+	if (size < 0 || fseek(f, 0, SEEK_SET) != 0) {
+		fclose(f);
+		return NULL;
+	}
+	*filesize = (uint32_t)size;
+	return f;
+}
+
+void* platform_create(const char* filename) {
+	return fopen(filename, "wb");
+}
+
+int platform_read(void* file, char* data, int len) {
+	return (int)fread(data, 1, len, (FILE*)file);
+}
+
+int platform_write(void* file, const char* data, int len) {
+	return (int)fwrite(data, 1, len, (FILE*)file);
+}
+
+void platform_close(void* file) {
+	fclose((FILE*)file);
+}
+
+static void usage() {
+	fprintf(stderr,
+		"Usage: coxel_headless [options] cart.cox\n"
+		"  -n frames   Number of frames to run, 0 runs until the cart stops (default %d)\n"
+		"  -i script   Scripted input file\n"
+		"  -s file     Write the final screen as a binary PPM image\n"
+		"  -p file     Profile opcodes and write the CSV report to file\n"
+		"  -r seed     Random seed (default %d)\n"
+		"  -q          Only print the summary line\n",
+		DEFAULT_FRAMES, DEFAULT_SEED);
+	exit(2);
+}
+
+static void load_script(const char* filename) {
+	FILE* f = fopen(filename, "r");
+	if (f == NULL) {
+		fprintf(stderr, "Open input script failed: %s\n", filename);
+		exit(2);
+	}
+	int cap = 0;
+	char line[256];
+	for (int linenum = 1; fgets(line, sizeof(line), f); linenum++) {
+		char* p = line;
+		while (*p == ' ' || *p == '\t')
+			p++;
+		if (*p == '#' || *p == '\n' || *p == '\r' || *p == 0)
+			continue;
+		int frame;
+		char action;
+		char name[32];
+		if (sscanf(p, "%d %c%31s", &frame, &action, name) != 3 || (action != '+' && action != '-')) {
+			fprintf(stderr, "%s:%d: Malformed input event.\n", filename, linenum);
+			exit(2);
+		}
+		int key = key_find(name, (int)strlen(name));
+		if (key == -1) {
+			fprintf(stderr, "%s:%d: Unknown key name.\n", filename, linenum);
+			exit(2);
+		}
+		if (g_event_cnt == cap) {
+			cap = cap ? cap * 2 : 64;
+			g_events = realloc(g_events, cap * sizeof(struct input_event));
+		}
+		g_events[g_event_cnt].frame = frame;
+		g_events[g_event_cnt].key = key;
+		g_events[g_event_cnt].pressed = action == '+';
+		g_event_cnt++;
+	}
+	fclose(f);
+}
+
+static void dump_screen(const char* filename) {
+	FILE* f = fopen(filename, "wb");
+	if (f == NULL) {
+		fprintf(stderr, "Create screen dump failed: %s\n", filename);
+		return;
+	}
+	fprintf(f, "P6\n%d %d\n255\n", WIDTH, HEIGHT);
+	for (int y = 0; y < HEIGHT; y++) {
+		for (int x = 0; x < WIDTH; x++) {
+			uint32_t c = palette[console_getpixel(x, y)];
+			fputc(c >> 16, f);
+			fputc((c >> 8) & 0xFF, f);
+			fputc(c & 0xFF, f);
+		}
+	}
+	fclose(f);
+}
+
+static int64_t now_us() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+int main(int argc, char** argv) {
+	int frames = DEFAULT_FRAMES;
+	int quiet = 0;
+	const char* script = NULL;
+	const char* screen = NULL;
+	const char* profile = NULL;
+	for (int i = 1; i < argc; i++) {
+		if (argv[i][0] != '-' || argv[i][1] == 0) {
+			if (g_cart_path)
+				usage();
+			g_cart_path = argv[i];
+		}
+		else if (argv[i][1] == 'q' && argv[i][2] == 0)
+			quiet = 1;
+		else if (argv[i][2] == 0 && i + 1 < argc) {
+			const char* arg = argv[++i];
+			switch (argv[i - 1][1]) {
+			case 'n': frames = atoi(arg); break;
+			case 'i': script = arg; break;
+			case 's': screen = arg; break;
+#ifdef CPU_PROFILE
+			case 'p': profile = arg; break;
+#endif
+			case 'r': g_seed = (uint32_t)strtoul(arg, NULL, 0); break;
+			default: usage();
+			}
+		}
+		else
+			usage();
+	}
+	if (g_cart_path == NULL)
+		usage();
+	if (script)
+		load_script(script);
+#ifdef CPU_PROFILE
+	if (profile) {
+		profile_reset();
+		profile_enable(1);
+	}
+#endif
+
+	console_factory_init();
+	if (!quiet)
+		printf("frame,cycles,delayed_frames,used_memory,wall_us\n");
+	int next_event = 0;
+	int frame;
+	int64_t total_us = 0;
+	int64_t total_cycles = 0;
+	int max_delayed = 0;
+	uint32_t peak_memory = 0;
+	for (frame = 0; frames == 0 || frame < frames; frame++) {
+		while (next_event < g_event_cnt && g_events[next_event].frame <= frame) {
+			struct input_event* e = &g_events[next_event++];
+			key_setstate(e->key, e->pressed);
+			if (e->pressed)
+				key_input(key_get_standard_input(e->key));
+		}
+		btn_standard_update();
+		int64_t start = now_us();
+		console_update();
+		int64_t elapsed = now_us() - start;
+		struct cpu* cpu = console_getcpu();
+		/* A delayed frame always consumes the whole budget */
+		int cycles = cpu->paused ? CYCLES_PER_FRAME : CYCLES_PER_FRAME - cpu->cycles;
+		total_us += elapsed;
+		total_cycles += cycles;
+		if (cpu->delayed_frames > max_delayed)
+			max_delayed = cpu->delayed_frames;
+		if (cpu->alloc.used_memory > peak_memory)
+			peak_memory = cpu->alloc.used_memory;
+		if (!quiet)
+			printf("%d,%d,%d,%u,%lld\n", frame, cycles, cpu->delayed_frames, cpu->alloc.used_memory, (long long)elapsed);
+		if (cpu->stopped) {
+			frame++;
+			break;
+		}
+	}
+	struct cpu* cpu = console_getcpu();
+	int stopped = cpu->stopped;
+	fprintf(stderr, "frames=%d wall_us=%lld total_cycles=%lld max_delayed_frames=%d used_memory=%u peak_memory=%u stopped=%d\n",
+		frame, (long long)total_us, (long long)total_cycles, max_delayed, cpu->alloc.used_memory, peak_memory, stopped);
+	if (screen)
+		dump_screen(screen);
+#ifdef CPU_PROFILE
+	if (profile) {
+		profile_enable(0);
+		void* f = platform_create(profile);
+		if (f == NULL || !profile_dump(f))
+			fprintf(stderr, "Write profile failed: %s\n", profile);
+		if (f)
+			platform_close(f);
+	}
+#endif
+	console_destroy();
+	return stopped ? 1 : 0;
+}
@@ -2,6 +2,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/mman.h>
 #include <X11/Xlib.h>
@@ -34,6 +35,10 @@ int platform_paste(char* ptr, int len) {
 	return 0;
 }
 
+uint32_t platform_seed() {
+	return (uint32_t)time(NULL);
+}
+
 void* platform_open(const char* filename, uint32_t* filesize) {
 	return fopen(filename, "rb");
 }
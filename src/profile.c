@@ -0,0 +1,209 @@
+#include "config.h"
+
+#ifdef CPU_PROFILE
+
+#include "cpu.h"
+#include "platform.h"
+#include "profile.h"
+#include "rand.h"
+#include "str.h"
+
+#include <stdarg.h>
+#include <stdlib.h>
+
+#define PROFILE_HASH_SIZE	16384 /* must be power of 2 */
+#define PROFILE_EMPTY		0xFFFFFFFF
+#define PROFILE_NONE		0xFF
+
+struct profile_slot {
+	uint32_t key;
+	uint64_t count;
+};
+
+struct profile_hash {
+	struct profile_slot slot[PROFILE_HASH_SIZE];
+	int cnt;
+	uint64_t dropped;
+};
+
+#define X(a, b, c, d, e)	#a,
+static const char* const opname[] = {
+	OPCODE_DEF(X)
+};
+#undef X
+
+int g_profile_enabled;
+static uint64_t g_op_count[op_CNT];
+static uint64_t g_pair_count[op_CNT][op_CNT];
+static struct profile_hash g_triple;
+static struct profile_hash g_pc;
+static uint8_t g_last[2];
+
+static void hash_reset(struct profile_hash* hash) {
+	for (int i = 0; i < PROFILE_HASH_SIZE; i++) {
+		hash->slot[i].key = PROFILE_EMPTY;
+		hash->slot[i].count = 0;
+	}
+	hash->cnt = 0;
+	hash->dropped = 0;
+}
+
+static void hash_add(struct profile_hash* hash, uint32_t key) {
+	uint32_t i = fmix32(key) & (PROFILE_HASH_SIZE - 1);
+	for (;;) {
+		struct profile_slot* slot = &hash->slot[i];
+		if (slot->key == key) {
+			slot->count++;
+			return;
+		}
+		if (slot->key == PROFILE_EMPTY) {
+			/* keep some room so probing stays short */
+			if (hash->cnt * 4 >= PROFILE_HASH_SIZE * 3) {
+				hash->dropped++;
+				return;
+			}
+			slot->key = key;
+			slot->count = 1;
+			hash->cnt++;
+			return;
+		}
+		i = (i + 1) & (PROFILE_HASH_SIZE - 1);
+	}
+}
+
+void profile_enable(int enabled) {
+	g_profile_enabled = enabled;
+}
+
+void profile_reset() {
+	for (int i = 0; i < op_CNT; i++) {
+		g_op_count[i] = 0;
+		for (int j = 0; j < op_CNT; j++)
+			g_pair_count[i][j] = 0;
+	}
+	hash_reset(&g_triple);
+	hash_reset(&g_pc);
+	profile_begin();
+}
+
+void profile_begin() {
+	/* sequences do not span separate runs */
+	g_last[0] = PROFILE_NONE;
+	g_last[1] = PROFILE_NONE;
+}
+
+void profile_record(struct cpu* cpu, struct code* code, uint32_t* pc) {
+	uint8_t op = OPCODE(*pc);
+	g_op_count[op]++;
+	if (g_last[1] != PROFILE_NONE) {
+		g_pair_count[g_last[1]][op]++;
+		if (g_last[0] != PROFILE_NONE)
+			hash_add(&g_triple, g_last[0] + (g_last[1] << 8) + (op << 16));
+	}
+	g_last[0] = g_last[1];
+	g_last[1] = op;
+	uint32_t code_id = (uint32_t)(code - (struct code*)readptr(cpu->code));
+	uint32_t ins_id = (uint32_t)(pc - (uint32_t*)readptr(code->ins));
+	hash_add(&g_pc, (code_id << 16) + ins_id);
+}
+
+struct profile_item {
+	uint32_t key;
+	uint64_t count;
+};
+
+static int item_cmp(const void* a, const void* b) {
+	const struct profile_item* x = (const struct profile_item*)a;
+	const struct profile_item* y = (const struct profile_item*)b;
+	if (x->count != y->count)
+		return x->count < y->count ? 1 : -1;
+	return x->key < y->key ? -1 : x->key > y->key;
+}
+
+static int dump_line(void* file, const char* format, ...) {
+	char buf[128];
+	va_list args;
+	va_start(args, format);
+	int len = str_vsprintf(buf, format, args);
+	va_end(args);
+	return platform_write(file, buf, len) == len;
+}
+
+#define DUMP_LINE(...) do { \
+		if (!dump_line(__VA_ARGS__)) \
+			goto fail; \
+	} while (0)
+
+int profile_dump(void* file) {
+	/* large enough for any of the tables */
+	int cap = op_CNT * op_CNT > PROFILE_HASH_SIZE ? op_CNT * op_CNT : PROFILE_HASH_SIZE;
+	struct profile_item* items = (struct profile_item*)platform_malloc(cap * sizeof(struct profile_item));
+	if (items == NULL)
+		return 0;
+	int cnt;
+	DUMP_LINE(file, "kind,key,count\n");
+	/* opcodes */
+	cnt = 0;
+	for (int i = 0; i < op_CNT; i++) {
+		if (g_op_count[i]) {
+			items[cnt].key = i;
+			items[cnt++].count = g_op_count[i];
+		}
+	}
+	qsort(items, cnt, sizeof(struct profile_item), item_cmp);
+	for (int i = 0; i < cnt; i++)
+		DUMP_LINE(file, "op,%s,%lld\n", opname[items[i].key] + 3, (int64_t)items[i].count);
+	/* pairs */
+	cnt = 0;
+	for (int i = 0; i < op_CNT; i++) {
+		for (int j = 0; j < op_CNT; j++) {
+			if (g_pair_count[i][j]) {
+				items[cnt].key = i + (j << 8);
+				items[cnt++].count = g_pair_count[i][j];
+			}
+		}
+	}
+	qsort(items, cnt, sizeof(struct profile_item), item_cmp);
+	for (int i = 0; i < cnt; i++) {
+		uint32_t key = items[i].key;
+		DUMP_LINE(file, "pair,%s %s,%lld\n", opname[key & 0xFF] + 3, opname[key >> 8] + 3, (int64_t)items[i].count);
+	}
+	/* triples */
+	cnt = 0;
+	for (int i = 0; i < PROFILE_HASH_SIZE; i++) {
+		if (g_triple.slot[i].key != PROFILE_EMPTY) {
+			items[cnt].key = g_triple.slot[i].key;
+			items[cnt++].count = g_triple.slot[i].count;
+		}
+	}
+	qsort(items, cnt, sizeof(struct profile_item), item_cmp);
+	for (int i = 0; i < cnt; i++) {
+		uint32_t key = items[i].key;
+		DUMP_LINE(file, "triple,%s %s %s,%lld\n", opname[key & 0xFF] + 3, opname[(key >> 8) & 0xFF] + 3,
+			opname[key >> 16] + 3, (int64_t)items[i].count);
+	}
+	if (g_triple.dropped)
+		DUMP_LINE(file, "triple,<dropped>,%lld\n", (int64_t)g_triple.dropped);
+	/* hot locations, key is function id and pc as shown by cpu_dump_code */
+	cnt = 0;
+	for (int i = 0; i < PROFILE_HASH_SIZE; i++) {
+		if (g_pc.slot[i].key != PROFILE_EMPTY) {
+			items[cnt].key = g_pc.slot[i].key;
+			items[cnt++].count = g_pc.slot[i].count;
+		}
+	}
+	qsort(items, cnt, sizeof(struct profile_item), item_cmp);
+	for (int i = 0; i < cnt; i++) {
+		uint32_t key = items[i].key;
+		DUMP_LINE(file, "pc,%d:%d,%lld\n", (int)(key >> 16), (int)(key & 0xFFFF), (int64_t)items[i].count);
+	}
+	if (g_pc.dropped)
+		DUMP_LINE(file, "pc,<dropped>,%lld\n", (int64_t)g_pc.dropped);
+	platform_free(items);
+	return 1;
+fail:
+	platform_free(items);
+	return 0;
+}
+
+#endif
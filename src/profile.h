@@ -0,0 +1,29 @@
+#ifndef _PROFILE_H
+#define _PROFILE_H
+
+#include "config.h"
+
+#ifdef CPU_PROFILE
+
+#include <stdint.h>
+
+struct cpu;
+struct code;
+
+/* Opcode profiler: counts executed opcodes, opcode pairs and triples and
+ * hot (code id, pc) locations. When disabled the interpreter runs on the
+ * regular dispatch table, so it costs nothing. */
+extern int g_profile_enabled;
+
+void profile_enable(int enabled);
+void profile_reset();
+/* Called by cpu_continue before resuming execution */
+void profile_begin();
+/* Record instruction at pc about to be executed */
+void profile_record(struct cpu* cpu, struct code* code, uint32_t* pc);
+/* Write results as CSV lines "kind,key,count", returns 0 on failure */
+int profile_dump(void* file);
+
+#endif
+
+#endif
@@ -0,0 +1,66 @@
+#include "alloc.h"
+#include "gc.h"
+#include "shape.h"
+
+/* Shapes
+ * A shape lists the keys of a table in insertion order, and tables with the
+ * same keys added in the same order share it, so they only need a vector of
+ * values. Adding a key moves the table to a child shape. Children are found
+ * through their parent, but only the tables keep them alive: the parent
+ * forgets a child when it is freed. A dead parent and its dead children go
+ * in the same sweep, in no particular order, so a parent freed first
+ * clears the parent of the children it still has.
+ * Shapes are leaves for the collector, marking one marks its keys and its
+ * ancestors, so the ancestors of a black shape are black.
+ */
+
+static struct shapeobj* shape_new(struct cpu* cpu, int key_cnt) {
+	struct shapeobj* shape = (struct shapeobj*)gc_alloc(cpu, t_shape, sizeof(struct shapeobj) + key_cnt * sizeof(ptr_t));
+	shape->parent = writeptr_nullable(NULL);
+	shape->child = writeptr_nullable(NULL);
+	shape->sibling = writeptr_nullable(NULL);
+	shape->child_cnt = 0;
+	shape->key_cnt = key_cnt;
+	return shape;
+}
+
+struct shapeobj* shape_new_root(struct cpu* cpu) {
+	return shape_new(cpu, 0);
+}
+
+void shape_destroy(struct cpu* cpu, struct shapeobj* shape) {
+	for (struct shapeobj* child = readptr_nullable(shape->child); child; child = readptr_nullable(child->sibling))
+		child->parent = writeptr_nullable(NULL);
+	struct shapeobj* parent = (struct shapeobj*)readptr_nullable(shape->parent);
+	if (parent) {
+		ptr_nullable(struct shapeobj)* prev = &parent->child;
+		while (readptr(*prev) != shape)
+			prev = &((struct shapeobj*)readptr(*prev))->sibling;
+		*prev = shape->sibling;
+		parent->child_cnt--;
+	}
+	mem_dealloc_pooled(&cpu->alloc, shape);
+}
+
+/* Shape with key added, NULL if the table should become a dictionary */
+struct shapeobj* shape_add(struct cpu* cpu, struct shapeobj* shape, struct strobj* key) {
+	for (struct shapeobj* child = readptr_nullable(shape->child); child; child = readptr_nullable(child->sibling)) {
+		if (child->keys[child->key_cnt - 1] == writeptr(key)) {
+			/* An unreachable child may have lost its keys to the sweep */
+			if (cpu->gcstate == gs_sweep && obj_get_mark(child) == gm_white)
+				continue;
+			return child;
+		}
+	}
+	if (shape->key_cnt >= SHAPE_MAX_KEYS || shape->child_cnt >= SHAPE_MAX_CHILDREN)
+		return NULL;
+	struct shapeobj* child = shape_new(cpu, shape->key_cnt + 1);
+	for (int i = 0; i < shape->key_cnt; i++)
+		child->keys[i] = shape->keys[i];
+	child->keys[shape->key_cnt] = writeptr(key);
+	child->parent = writeptr(shape);
+	child->sibling = shape->child;
+	shape->child = writeptr(child);
+	shape->child_cnt++;
+	return child;
+}
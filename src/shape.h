@@ -0,0 +1,22 @@
+#ifndef _SHAPE_H
+#define _SHAPE_H
+
+#include "cpu.h"
+
+/* Tables with more keys, or one more transition, become dictionaries */
+#define SHAPE_MAX_KEYS		32
+#define SHAPE_MAX_CHILDREN	8
+
+struct shapeobj* shape_new_root(struct cpu* cpu);
+void shape_destroy(struct cpu* cpu, struct shapeobj* shape);
+struct shapeobj* shape_add(struct cpu* cpu, struct shapeobj* shape, struct strobj* key);
+
+/* Slot of key, -1 if the shape does not have it */
+static FORCEINLINE int shape_find(struct cpu* cpu, struct shapeobj* shape, struct strobj* key) {
+	for (int i = shape->key_cnt - 1; i >= 0; i--)
+		if (shape->keys[i] == writeptr(key))
+			return i;
+	return -1;
+}
+
+#endif
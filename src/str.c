@@ -175,29 +175,81 @@ int str_vsprintf(char* buf, const char* format, va_list args) {
 }
 
 #define INITIAL_STRTAB_SIZE		1024 /* must be power of 2 */
+#define STRTAB_REHASH_BUCKETS	8 /* old buckets moved per interned string */
+
+static ptr_nullable(struct strobj)* strtab_new(struct cpu* cpu, int size) {
+	ptr_nullable(struct strobj)* strtab = (ptr_nullable(struct strobj)*)mem_alloc(&cpu->alloc, size * sizeof(ptr_t));
+	if (strtab == NULL)
+		return NULL;
+	for (int i = 0; i < size; i++)
+		strtab[i] = writeptr_nullable(NULL);
+	return strtab;
+}
 
 void strtab_init(struct cpu* cpu) {
 	cpu->strtab_cnt = 0;
 	cpu->strtab_size = INITIAL_STRTAB_SIZE;
-	ptr(struct strobj)* strtab = (ptr(struct strobj)*)mem_alloc(&cpu->alloc, cpu->strtab_size * sizeof(ptr_t));
-	for (int i = 0; i < cpu->strtab_size; i++)
-		strtab[i] = writeptr_nullable(NULL);
-	cpu->strtab = writeptr(strtab);
+	cpu->strtab = writeptr(strtab_new(cpu, cpu->strtab_size));
+	cpu->strtab_old = writeptr_nullable(NULL);
+	cpu->strtab_old_size = 0;
+	cpu->strtab_rehash = 0;
 }
 
 static void strtab_grow(struct cpu* cpu) {
-	platform_error("Not implemented.");
+	/* Keep using the full table when there is no memory for a bigger one */
+	ptr_nullable(struct strobj)* strtab = strtab_new(cpu, cpu->strtab_size * 2);
+	if (strtab == NULL)
+		return;
+	cpu->strtab_old = cpu->strtab;
+	cpu->strtab_old_size = cpu->strtab_size;
+	cpu->strtab_rehash = 0;
+	cpu->strtab = writeptr(strtab);
+	cpu->strtab_size *= 2;
+}
+
+/* Move a few buckets of the old table over, so no single allocation pays for a full rehash */
+static void strtab_rehash_step(struct cpu* cpu) {
+	ptr_nullable(struct strobj)* strtab = (ptr_nullable(struct strobj)*)readptr(cpu->strtab);
+	ptr_nullable(struct strobj)* old = (ptr_nullable(struct strobj)*)readptr(cpu->strtab_old);
+	int end = cpu->strtab_rehash + STRTAB_REHASH_BUCKETS;
+	if (end > cpu->strtab_old_size)
+		end = cpu->strtab_old_size;
+	for (; cpu->strtab_rehash < end; cpu->strtab_rehash++) {
+		struct strobj* p = readptr_nullable(old[cpu->strtab_rehash]);
+		while (p) {
+			struct strobj* next = readptr_nullable(p->next);
+			uint32_t bucket = p->hash & (cpu->strtab_size - 1);
+			p->next = strtab[bucket];
+			strtab[bucket] = writeptr(p);
+			cpu->cycles -= CYCLES_TRAVERSE;
+			p = next;
+		}
+	}
+	if (cpu->strtab_rehash == cpu->strtab_old_size) {
+		mem_dealloc(&cpu->alloc, old);
+		cpu->strtab_old = writeptr_nullable(NULL);
+		cpu->strtab_old_size = 0;
+	}
+}
+
+/* Chain head the string with hash lives in */
+static ptr_nullable(struct strobj)* strtab_chain(struct cpu* cpu, uint32_t hash) {
+	if (cpu->strtab_old_size) {
+		uint32_t bucket = hash & (cpu->strtab_old_size - 1);
+		if ((int)bucket >= cpu->strtab_rehash)
+			return &((ptr_nullable(struct strobj)*)readptr(cpu->strtab_old))[bucket];
+	}
+	return &((ptr_nullable(struct strobj)*)readptr(cpu->strtab))[hash & (cpu->strtab_size - 1)];
 }
 
 void str_destroy(struct cpu* cpu, struct strobj* str) {
 	/* Remove from intern table */
-	uint32_t bucket = str->hash % cpu->strtab_size;
-	ptr(struct strobj)* strtab = (ptr(struct strobj)*)readptr(cpu->strtab);
-	ptr_t* prev = &strtab[bucket];
+	ptr_t* prev = strtab_chain(cpu, str->hash);
 	for (struct strobj* p = readptr(*prev); p; prev = &p->next, p = readptr(*prev)) {
 		if (p == str) {
 			*prev = p->next;
-			mem_dealloc(&cpu->alloc, p);
+			cpu->strtab_cnt--;
+			mem_dealloc_pooled(&cpu->alloc, p);
 			return;
 		}
 	}
@@ -206,18 +258,18 @@ void str_destroy(struct cpu* cpu, struct strobj* str) {
 
 static struct strobj* str_parts_intern_impl(struct cpu* cpu, const struct str_part* parts, int nparts, int nogc) {
 	uint32_t hash = str_parts_hash(parts, nparts);
-	uint32_t bucket = hash % cpu->strtab_size;
-	ptr_nullable(struct strobj)* strtab = (ptr_nullable(struct strobj)*)readptr(cpu->strtab);
-	for (struct strobj* p = readptr_nullable(strtab[bucket]); p; p = readptr_nullable(p->next)) {
-		if (hash == p->hash && str_parts_equal(parts, nparts, p->data, p->len))
+	for (struct strobj* p = readptr_nullable(*strtab_chain(cpu, hash)); p; p = readptr_nullable(p->next)) {
+		if (hash == p->hash && str_parts_equal(parts, nparts, p->data, p->len)) {
+			/* Unreachable strings may be found before the sweep frees them */
+			if (cpu->gcstate == gs_sweep && obj_get_mark(p) == gm_white)
+				obj_mark(p, gm_black);
 			return p;
+		}
 	}
-	if (cpu->strtab_cnt * 4 >= cpu->strtab_size * 3) { /* >75% load? */
-		/* rehash */
+	if (cpu->strtab_old_size)
+		strtab_rehash_step(cpu);
+	else if (cpu->strtab_cnt * 4 >= cpu->strtab_size * 3) /* >75% load? */
 		strtab_grow(cpu);
-		strtab = (ptr(struct strobj)*)readptr(cpu->strtab);
-		bucket = hash % cpu->strtab_size;
-	}
 	uint32_t len = 0;
 	for (int i = 0; i < nparts; i++)
 		len += parts[i].len;
@@ -234,8 +286,11 @@ static struct strobj* str_parts_intern_impl(struct cpu* cpu, const struct str_pa
 		memcpy(p, part->data, part->len);
 		p += part->len;
 	}
-	obj->next = strtab[bucket];
-	strtab[bucket] = writeptr(obj);
+	/* The chain is looked up after allocating, which may free strings */
+	ptr_nullable(struct strobj)* chain = strtab_chain(cpu, hash);
+	obj->next = *chain;
+	*chain = writeptr(obj);
+	cpu->strtab_cnt++;
 	return obj;
 }
 
@@ -274,7 +329,7 @@ value_t str_get(struct cpu* cpu, struct strobj* str, number index) {
 	if (idx >= str->len)
 		return value_undef();
 	else
-		return value_str(str_intern(cpu, &str->data[idx], 1));
+		return value_str(str_char(cpu, &str->data[idx]));
 }
 
 #define SUFFIX
@@ -33,6 +33,13 @@ struct strobj* str_intern(struct cpu* cpu, const char* str, int len);
 struct strobj* str_intern_nogc(struct cpu* cpu, const char* str, int len);
 struct strobj* str_parts_intern(struct cpu* cpu, const struct str_part* parts, int nparts);
 struct strobj* str_parts_intern_nogc(struct cpu* cpu, const struct str_part* parts, int nparts);
+/* Interned string of the single character at ch */
+static FORCEINLINE struct strobj* str_char(struct cpu* cpu, const char* ch) {
+	uint32_t i = (uint8_t)*ch - STRCHR_FIRST;
+	if (likely(i < STRCHR_CNT))
+		return (struct strobj*)readptr(cpu->_chr[i]);
+	return str_intern(cpu, ch, 1);
+}
 struct strobj* str_concat(struct cpu* cpu, struct strobj* lval, struct strobj* rval);
 value_t str_get(struct cpu* cpu, struct strobj* str, number index);
 value_t str_fget(struct cpu* cpu, struct strobj* str, struct strobj* key);
@@ -0,0 +1,95 @@
+#include "alloc.h"
+#include "arith.h"
+#include "gc.h"
+#include "str.h"
+#include "strbuf.h"
+
+#include <string.h>
+
+struct strbufobj* strbuf_new(struct cpu* cpu) {
+	struct strbufobj* sb = (struct strbufobj*)gc_alloc(cpu, t_strbuf, sizeof(struct strbufobj));
+	sb->len = 0;
+	sb->cap = 0;
+	sb->data = writeptr_nullable(NULL);
+	return sb;
+}
+
+void strbuf_destroy(struct cpu* cpu, struct strbufobj* sb) {
+	mem_dealloc(&cpu->alloc, readptr_nullable(sb->data));
+	mem_dealloc_pooled(&cpu->alloc, sb);
+}
+
+void strbuf_append(struct cpu* cpu, struct strbufobj* sb, const char* data, int len) {
+	char* buf = (char*)readptr_nullable(sb->data);
+	if (sb->len + len > sb->cap) {
+		uint32_t cap = sb->cap == 0 ? 16 : sb->cap * 2;
+		while (cap < sb->len + len)
+			cap *= 2;
+		buf = (char*)mem_realloc(&cpu->alloc, buf, cap);
+		if (buf == NULL)
+			runtime_error(cpu, "Out of memory.");
+		sb->data = writeptr(buf);
+		sb->cap = cap;
+		cpu->cycles -= CYCLES_ALLOC;
+	}
+	memcpy(buf + sb->len, data, len);
+	sb->len += len;
+	cpu->cycles -= CYCLES_CHARS(len);
+}
+
+void strbuf_append_value(struct cpu* cpu, struct strbufobj* sb, value_t value) {
+	/* Numbers are formatted in place so they are not interned either */
+	if (value_is_num(value)) {
+		char buf[20];
+		int len = num_format(value_get_num(value), 4, buf);
+		strbuf_append(cpu, sb, buf, len);
+	}
+	else if (value_get_type(value) == t_strbuf) {
+		struct strbufobj* other = (struct strbufobj*)value_get_object(value);
+		strbuf_append(cpu, sb, (const char*)readptr_nullable(other->data), other->len);
+	}
+	else {
+		struct strobj* str = to_string(cpu, value);
+		strbuf_append(cpu, sb, str->data, str->len);
+	}
+}
+
+struct strobj* strbuf_intern(struct cpu* cpu, struct strbufobj* sb) {
+	cpu->cycles -= CYCLES_CHARS(sb->len);
+	if (sb->len == 0)
+		return LIT(EMPTY);
+	return str_intern(cpu, (const char*)readptr(sb->data), sb->len);
+}
+
+value_t libstrbuf_append(struct cpu* cpu, int sp, int nargs) {
+	struct strbufobj* sb = to_strbuf(cpu, THIS);
+	for (int i = 0; i < nargs; i++)
+		strbuf_append_value(cpu, sb, ARG(i));
+	return THIS;
+}
+
+value_t libstrbuf_clear(struct cpu* cpu, int sp, int nargs) {
+	if (unlikely(nargs != 0))
+		argument_error(cpu);
+	to_strbuf(cpu, THIS)->len = 0;
+	return THIS;
+}
+
+value_t libstrbuf_toString(struct cpu* cpu, int sp, int nargs) {
+	if (unlikely(nargs != 0))
+		argument_error(cpu);
+	return value_str(strbuf_intern(cpu, to_strbuf(cpu, THIS)));
+}
+
+value_t strbuf_fget(struct cpu* cpu, struct strbufobj* sb, struct strobj* key) {
+	if (key == LIT(append))
+		return value_cfunc(cf_libstrbuf_append);
+	else if (key == LIT(clear))
+		return value_cfunc(cf_libstrbuf_clear);
+	else if (key == LIT(toString))
+		return value_cfunc(cf_libstrbuf_toString);
+	else if (key == LIT(length))
+		return value_num(num_kuint(sb->len));
+	else
+		return value_undef();
+}
@@ -0,0 +1,13 @@
+#ifndef _STRBUF_H
+#define _STRBUF_H
+
+#include "cpu.h"
+
+struct strbufobj* strbuf_new(struct cpu* cpu);
+void strbuf_destroy(struct cpu* cpu, struct strbufobj* sb);
+void strbuf_append(struct cpu* cpu, struct strbufobj* sb, const char* data, int len);
+void strbuf_append_value(struct cpu* cpu, struct strbufobj* sb, value_t value);
+struct strobj* strbuf_intern(struct cpu* cpu, struct strbufobj* sb);
+value_t strbuf_fget(struct cpu* cpu, struct strbufobj* sb, struct strobj* key);
+
+#endif
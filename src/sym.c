@@ -3,21 +3,46 @@
 
 #include <string.h>
 
+/* Symbols are stacked down from the end of data, a level header is pushed
+ * before the symbols of each nested level. Lookups go through hash chains
+ * linking every symbol to the one that was newest in its chain when it was
+ * declared, so the innermost declaration of a name is found first. Popping
+ * a level unlinks its symbols, which are always the newest in their chain.
+ */
+
+#define sym_hash(key, len)	(str_hash(key, len) & (SYM_HASH_SIZE - 1))
+
+/* keeps headers and symbols 2-byte aligned */
+static int sym_size(int len) {
+	return (sizeof(struct sym) + len + 1) & ~1;
+}
+
 void sym_init(struct sym_table* sym_table) {
 	sym_table->level = 0;
+	memset(sym_table->head, 0, sizeof(sym_table->head));
 	sym_table->top = sym_table->data + sizeof(sym_table->data);
 	sym_table->last_top = sym_table->top;
 }
 
-void sym_push(struct sym_table* sym_table) {
+/* Returns 0 if the table is full */
+int sym_push(struct sym_table* sym_table) {
+	if (sym_table->top - sym_table->data < (int)sizeof(struct sym_level))
+		return 0;
 	sym_table->top -= sizeof(struct sym_level);
 	struct sym_level* sym_level = (struct sym_level*)sym_table->top;
-	sym_level->size = sym_table->last_top - sym_table->top;
+	sym_level->size = (uint16_t)(sym_table->last_top - sym_table->top);
+	sym_level->needclose = 0;
 	sym_table->last_top = sym_table->top;
 	++sym_table->level;
+	return 1;
 }
 
 void sym_pop(struct sym_table* sym_table) {
+	for (uint8_t* top = sym_table->top; top < sym_table->last_top;) {
+		struct sym* sym = (struct sym*)top;
+		sym_table->head[sym_hash(sym->key, sym->len)] = sym->next;
+		top += sym_size(sym->len);
+	}
 	struct sym_level* sym_level = (struct sym_level*)sym_table->last_top;
 	sym_table->top = sym_table->last_top + sizeof(struct sym_level);
 	sym_table->last_top += sym_level->size;
@@ -25,36 +50,25 @@ void sym_pop(struct sym_table* sym_table) {
 }
 
 int sym_level_needclose(struct sym_table* sym_table) {
-	for (uint8_t* top = sym_table->top; top < sym_table->last_top;) {
-		struct sym* sym = (struct sym*)top;
-		if (sym->upval_used)
-			return 1;
-		top += sizeof(struct sym) + sym->len;
-	}
-	return 0;
+	return ((struct sym_level*)sym_table->last_top)->needclose;
 }
 
 struct sym* sym_find(struct sym_table* sym_table, int min_level, const char* key, uint8_t len, int* out_level) {
-	uint8_t* top = sym_table->top;
-	uint8_t* last_top = sym_table->last_top;
-	for (int level = sym_table->level; level >= min_level; level--) {
-		/* search in this level */
-		while (top < last_top) {
-			struct sym* sym = (struct sym*)top;
-			if (str_equal(key, len, sym->key, sym->len)) {
-				*out_level = level;
-				return sym;
-			}
-			top += sizeof(struct sym) + sym->len;
+	uint16_t p = sym_table->head[sym_hash(key, len)];
+	while (p) {
+		struct sym* sym = (struct sym*)&sym_table->data[p - 1];
+		if (str_equal(key, len, sym->key, sym->len)) {
+			if (sym->level < min_level)
+				return NULL;
+			*out_level = sym->level;
+			return sym;
 		}
-		/* go up one level */
-		struct sym_level* sym_level = (struct sym_level*)last_top;
-		top += sizeof(struct sym_level);
-		last_top += sym_level->size;
+		p = sym->next;
 	}
 	return NULL;
 }
 
+/* Returns 1 if created, 0 if found, -1 if the table is full */
 int sym_emplace(struct sym_table* sym_table, int min_level, const char* key, uint8_t len, struct sym** out_sym) {
 	int level;
 	struct sym* sym = sym_find(sym_table, min_level, key, len, &level);
@@ -63,13 +77,33 @@ int sym_emplace(struct sym_table* sym_table, int min_level, const char* key, uin
 		return 0;
 	}
 	/* not found, create new one */
-	const uint16_t size = sizeof(struct sym) + len;
-	// TODO: Detect out of memory
+	int size = sym_size(len);
+	if (sym_table->top - sym_table->data < size) {
+		*out_sym = NULL;
+		return -1;
+	}
 	sym_table->top -= size;
 	sym = (struct sym*)sym_table->top;
+	uint16_t* head = &sym_table->head[sym_hash(key, len)];
+	sym->next = *head;
+	*head = (uint16_t)(sym_table->top - sym_table->data + 1);
+	sym->level = (uint16_t)sym_table->level;
 	sym->upval_used = 0;
 	sym->len = len;
 	memcpy(sym->key, key, len);
 	*out_sym = sym;
 	return 1;
 }
+
+/* Marks a symbol used by an inner function, its level closes upvalues */
+void sym_capture(struct sym_table* sym_table, struct sym* sym) {
+	if (sym->upval_used)
+		return;
+	sym->upval_used = 1;
+	if (sym->level == 0)
+		return;
+	uint8_t* p = sym_table->last_top;
+	for (int level = sym_table->level; level > sym->level; level--)
+		p += ((struct sym_level*)p)->size;
+	((struct sym_level*)p)->needclose = 1;
+}
@@ -3,7 +3,12 @@
 
 #include <stdint.h>
 
+#define SYM_TABLE_SIZE	8192
+#define SYM_HASH_SIZE	128
+
 struct sym {
+	uint16_t next; /* shadowed or colliding symbol, see sym.c */
+	uint16_t level;
 	uint8_t reg;
 	uint8_t upval_used;
 	uint8_t len;
@@ -12,20 +17,24 @@ struct sym {
 
 struct sym_level {
 	uint16_t size;
+	uint16_t needclose;
 };
 
 struct sym_table {
 	int level;
-	uint8_t data[8192];
+	/* newest symbol of each hash chain, data offset + 1 */
+	uint16_t head[SYM_HASH_SIZE];
+	uint8_t data[SYM_TABLE_SIZE - SYM_HASH_SIZE * sizeof(uint16_t)];
 	uint8_t* top;
 	uint8_t* last_top;
 };
 
 void sym_init(struct sym_table* sym_table);
-void sym_push(struct sym_table* sym_table);
+int sym_push(struct sym_table* sym_table);
 void sym_pop(struct sym_table* sym_table);
 int sym_level_needclose(struct sym_table* sym_table);
 struct sym* sym_find(struct sym_table* sym_table, int min_level, const char* key, uint8_t len, int* out_level);
 int sym_emplace(struct sym_table* sym_table, int min_level, const char* key, uint8_t len, struct sym** out_sym);
+void sym_capture(struct sym_table* sym_table, struct sym* sym);
 
 #endif
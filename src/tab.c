@@ -1,96 +1,539 @@
 #include "alloc.h"
 #include "gc.h"
+#include "shape.h"
 #include "tab.h"
 
+#include <string.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define TAB_SSE2
+#endif
+
+/* Hash part
+ * Entries are appended in insertion order and only move when a grow packs
+ * out deleted ones, so their indices can be cached. The index over them is
+ * an open addressing table split into groups of TAB_GROUP slots, each with a
+ * control byte holding the low 7 bits of the key hash, or one of the markers
+ * below. A lookup matches the control bytes of a whole group at once and
+ * only compares keys on a hit, so it usually touches one group and one
+ * entry. The high hash bits pick the first group, then groups are probed
+ * triangularly until one has an empty slot.
+ */
+#define CTRL_EMPTY		0x80
+#define CTRL_DELETED	0xFE
+#define ctrl_h2(hash)	((uint8_t)((hash) & 0x7F))
+#define ctrl_h1(hash)	((hash) >> 7)
+#define TAB_LOAD_NUM	7 /* usable slots per TAB_GROUP slots */
+#define TAB_ENTRY_MIN	4
+
+/* Array part
+ * Keys are strings, and num_to_str turns a whole number into its decimal
+ * form. Such keys below arr_cnt are kept in the array part instead of the
+ * hash part, where holes mark the absent ones, so number keys need neither a
+ * string nor a hash lookup. Keys above stay in the hash part until the array
+ * part grows over them, which it does when at least half of it is in use.
+ */
+#define TAB_ARR_MIN		4
+
 struct tabobj* tab_new(struct cpu* cpu) {
 	struct tabobj* tab = (struct tabobj*)gc_alloc(cpu, t_tab, sizeof(struct tabobj));
+	tab->shape = cpu->shape_root;
+	tab->slot = writeptr_nullable(NULL);
+	tab->slot_cap = 0;
 	tab->entry_cnt = 0;
+	tab->entry_top = 0;
+	tab->entry_used = 0;
 	tab->entry = writeptr_nullable(NULL);
-	tab->freelist = TAB_NULL;
-	tab->bucket_cnt = 0;
-	tab->bucket = writeptr_nullable(NULL);
+	tab->group_cnt = 0;
+	tab->growth_left = 0;
+	tab->group = writeptr_nullable(NULL);
+	tab->arr_cnt = 0;
+	tab->arr_used = 0;
+	tab->hidx_cnt = 0;
+	tab->arr = writeptr_nullable(NULL);
 	return tab;
 }
 
 void tab_destroy(struct cpu* cpu, struct tabobj* tab) {
+	mem_dealloc(&cpu->alloc, readptr_nullable(tab->slot));
 	mem_dealloc(&cpu->alloc, readptr_nullable(tab->entry));
-	mem_dealloc(&cpu->alloc, readptr_nullable(tab->bucket));
-	mem_dealloc(&cpu->alloc, tab);
+	mem_dealloc(&cpu->alloc, readptr_nullable(tab->group));
+	mem_dealloc(&cpu->alloc, readptr_nullable(tab->arr));
+	mem_dealloc_pooled(&cpu->alloc, tab);
 }
 
-static void tab_grow(struct cpu* cpu, struct tabobj* tab) {
-	/* grow freelist */
-	int new_entry_cnt = tab->entry_cnt == 0 ? 4 : tab->entry_cnt * 2;
-	struct tabent* entries = (struct tabent*)mem_realloc(&cpu->alloc, readptr_nullable(tab->entry), new_entry_cnt * sizeof(struct tabent));
-	tab->entry = writeptr(entries);
-	tab->freelist = tab->entry_cnt;
-	for (uint16_t i = tab->entry_cnt; i < new_entry_cnt; i++)
-		entries[i].next = i + 1;
-	entries[new_entry_cnt - 1].next = TAB_NULL;
-	if (new_entry_cnt * 4 > tab->bucket_cnt * 3) {
-		/* grow hash table */
-		int new_bucket_cnt = tab->bucket_cnt == 0 ? 16 : tab->bucket_cnt * 2;
-		uint16_t* buckets = (uint16_t*)mem_realloc(&cpu->alloc, readptr_nullable(tab->bucket), new_bucket_cnt * sizeof(uint16_t));
-		tab->bucket = writeptr(buckets);
-		for (uint16_t i = 0; i < new_bucket_cnt; i++)
-			buckets[i] = TAB_NULL;
-		for (uint16_t i = 0; i < tab->entry_cnt; i++) {
-			struct tabent* ent = &entries[i];
-			uint16_t bucket = ((struct strobj*)readptr(ent->key))->hash % new_bucket_cnt;
-			ent->next = buckets[bucket];
-			buckets[bucket] = i;
+/* Array index the key stands for, -1 if it is not the decimal form of a
+ * whole number */
+static int str_index(struct strobj* key) {
+	if (key->len == 0 || key->len > 5 || (key->data[0] == '0' && key->len > 1))
+		return -1;
+	int index = 0;
+	for (uint32_t i = 0; i < key->len; i++) {
+		uint8_t digit = (uint8_t)(key->data[i] - '0');
+		if (digit > 9)
+			return -1;
+		index = index * 10 + digit;
+	}
+	return index < (1 << (INT_BITS - 1)) ? index : -1;
+}
+
+/* Array part slot of key, NULL if the key belongs to the hash part */
+static value_t* tab_arr_slot(struct cpu* cpu, struct tabobj* tab, struct strobj* key) {
+	if (!tab->arr_cnt)
+		return NULL;
+	int index = str_index(key);
+	if (index < 0 || index >= tab->arr_cnt)
+		return NULL;
+	return &((value_t*)readptr(tab->arr))[index];
+}
+
+/* Group matching, bit i of the result is set if control byte i matches */
+#ifdef TAB_SSE2
+
+static FORCEINLINE uint32_t group_match(const struct tabgroup* grp, uint8_t ctrl) {
+	__m128i v = _mm_loadl_epi64((const __m128i*)grp->ctrl);
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8((char)ctrl))) & 0xFF;
+}
+
+/* Empty or deleted */
+static FORCEINLINE uint32_t group_match_free(const struct tabgroup* grp) {
+	return _mm_movemask_epi8(_mm_loadl_epi64((const __m128i*)grp->ctrl)) & 0xFF;
+}
+
+#else
+
+#define SWAR_LSB	0x0101010101010101ull
+#define SWAR_MSB	0x8080808080808080ull
+
+/* Gather the high bit of each byte into the low byte */
+#define swar_mask(x)	((uint32_t)((((x) >> 7) * 0x0102040810204080ull) >> 56))
+
+static FORCEINLINE uint32_t group_match(const struct tabgroup* grp, uint8_t ctrl) {
+	uint64_t v;
+	memcpy(&v, grp->ctrl, sizeof(v));
+	v ^= SWAR_LSB * ctrl;
+	/* exact zero byte test, no false positives from borrows */
+	uint64_t t = (v & ~SWAR_MSB) + ~SWAR_MSB;
+	return swar_mask(~(t | v | ~SWAR_MSB));
+}
+
+static FORCEINLINE uint32_t group_match_free(const struct tabgroup* grp) {
+	uint64_t v;
+	memcpy(&v, grp->ctrl, sizeof(v));
+	return swar_mask(v & SWAR_MSB);
+}
+
+#endif
+
+/* Index position of key, -1 if it is absent */
+static int tab_find(struct cpu* cpu, struct tabobj* tab, struct strobj* key) {
+	if (!tab->group_cnt)
+		return -1;
+	struct tabgroup* groups = (struct tabgroup*)readptr(tab->group);
+	struct tabent* entries = (struct tabent*)readptr(tab->entry);
+	uint32_t mask = tab->group_cnt - 1;
+	uint32_t g = ctrl_h1(key->hash) & mask;
+	uint8_t h2 = ctrl_h2(key->hash);
+	for (uint32_t step = 1;; step++) {
+		struct tabgroup* grp = &groups[g];
+		for (uint32_t m = group_match(grp, h2); m; m &= m - 1) {
+			int i = leastbitidx(m);
+			if (entries[grp->slot[i]].key == writeptr(key))
+				return g * TAB_GROUP + i;
 		}
-		tab->bucket_cnt = new_bucket_cnt;
+		if (group_match(grp, CTRL_EMPTY))
+			return -1;
+		g = (g + step) & mask;
 	}
+}
+
+/* First empty or deleted index position on the probe sequence of hash */
+static int tab_find_free(struct tabobj* tab, struct tabgroup* groups, uint32_t hash) {
+	uint32_t mask = tab->group_cnt - 1;
+	uint32_t g = ctrl_h1(hash) & mask;
+	for (uint32_t step = 1;; step++) {
+		uint32_t m = group_match_free(&groups[g]);
+		if (m)
+			return g * TAB_GROUP + leastbitidx(m);
+		g = (g + step) & mask;
+	}
+}
+
+/* Rebuild the index from the entries, sized to be at most half full */
+static void tab_rehash(struct cpu* cpu, struct tabobj* tab) {
+	struct tabent* entries = (struct tabent*)readptr_nullable(tab->entry);
+	int live = tab->entry_used;
+	int group_cnt = 1;
+	while ((live + 1) * 2 > group_cnt * TAB_LOAD_NUM)
+		group_cnt *= 2;
+	struct tabgroup* groups;
+	if (group_cnt != tab->group_cnt) {
+		mem_dealloc(&cpu->alloc, readptr_nullable(tab->group));
+		groups = (struct tabgroup*)mem_alloc(&cpu->alloc, group_cnt * sizeof(struct tabgroup));
+		tab->group = writeptr(groups);
+		tab->group_cnt = group_cnt;
+	}
+	else
+		groups = (struct tabgroup*)readptr(tab->group);
+	/* slots of empty controls are never read, but keep them in range */
+	memset(groups, 0, group_cnt * sizeof(struct tabgroup));
+	for (int g = 0; g < group_cnt; g++)
+		memset(groups[g].ctrl, CTRL_EMPTY, TAB_GROUP);
+	for (int p = 0; p < tab->entry_top; p++) {
+		if (!entries[p].key)
+			continue;
+		uint32_t hash = ((struct strobj*)readptr(entries[p].key))->hash;
+		int pos = tab_find_free(tab, groups, hash);
+		groups[pos / TAB_GROUP].ctrl[pos % TAB_GROUP] = ctrl_h2(hash);
+		groups[pos / TAB_GROUP].slot[pos % TAB_GROUP] = p;
+	}
+	tab->growth_left = group_cnt * TAB_LOAD_NUM - live;
+}
+
+/* Make room for an entry at the top. Deleted entries are packed out on the
+ * way, which keeps the order but moves the entries, so the size follows
+ * the keys left and shrinks a table that lost most of them */
+static void tab_grow(struct cpu* cpu, struct tabobj* tab) {
+	struct tabent* entries = (struct tabent*)readptr_nullable(tab->entry);
+	int used = 0;
+	if (tab->entry_used < tab->entry_top) {
+		for (int p = 0; p < tab->entry_top; p++)
+			if (entries[p].key)
+				entries[used++] = entries[p];
+	}
+	else
+		used = tab->entry_top;
+	int new_entry_cnt = TAB_ENTRY_MIN;
+	while (new_entry_cnt < used * 2)
+		new_entry_cnt *= 2;
+	entries = (struct tabent*)mem_realloc(&cpu->alloc, entries, new_entry_cnt * sizeof(struct tabent));
+	tab->entry = writeptr(entries);
+	/* entries above the top never match a key, see tab_get_cached */
+	for (int i = used; i < new_entry_cnt; i++)
+		entries[i].key = writeptr_nullable(NULL);
 	tab->entry_cnt = new_entry_cnt;
+	if (used < tab->entry_top) {
+		tab->entry_top = used;
+		tab_rehash(cpu, tab);
+	}
 }
 
-static uint16_t tab_find(struct cpu* cpu, struct tabobj* tab, struct strobj* key, uint16_t* out_prev) {
-	if (!tab->bucket_cnt)
-		return TAB_NULL;
-	uint16_t bucket = key->hash % tab->bucket_cnt;
-	uint16_t p = ((uint16_t*)readptr(tab->bucket))[bucket];
-	uint16_t prev = TAB_NULL;
-	while (p != TAB_NULL) {
-		struct tabent* ent = &((struct tabent*)readptr(tab->entry))[p];
-		if (ent->key == writeptr(key)) {
-			if (out_prev)
-				*out_prev = prev;
-			return p;
+/* Drop the key from the index, its entry stays in place without a key */
+static void tab_unlink(struct cpu* cpu, struct tabobj* tab, struct strobj* key) {
+	int pos = tab_find(cpu, tab, key);
+	struct tabgroup* grp = &((struct tabgroup*)readptr(tab->group))[pos / TAB_GROUP];
+	uint32_t p = grp->slot[pos % TAB_GROUP];
+	/* no probe went on past a group with an empty slot */
+	if (group_match(grp, CTRL_EMPTY)) {
+		grp->ctrl[pos % TAB_GROUP] = CTRL_EMPTY;
+		tab->growth_left++;
+	}
+	else
+		grp->ctrl[pos % TAB_GROUP] = CTRL_DELETED;
+	struct tabent* ent = &((struct tabent*)readptr(tab->entry))[p];
+	ent->key = writeptr_nullable(NULL);
+	ent->value = value_hole();
+	tab->entry_used--;
+}
+
+static void tab_free_hash(struct cpu* cpu, struct tabobj* tab) {
+	mem_dealloc(&cpu->alloc, readptr_nullable(tab->entry));
+	mem_dealloc(&cpu->alloc, readptr_nullable(tab->group));
+	tab->entry_cnt = 0;
+	tab->entry_top = 0;
+	tab->entry = writeptr_nullable(NULL);
+	tab->group_cnt = 0;
+	tab->growth_left = 0;
+	tab->group = writeptr_nullable(NULL);
+}
+
+int tab_grow_arr(struct cpu* cpu, struct tabobj* tab, int index) {
+	int new_arr_cnt = tab->arr_cnt == 0 ? TAB_ARR_MIN : tab->arr_cnt;
+	while (new_arr_cnt <= index)
+		new_arr_cnt *= 2;
+	if (new_arr_cnt > TAB_ARR_MIN && (tab->arr_used + tab->hidx_cnt + 1) * 2 < new_arr_cnt)
+		return 0;
+	value_t* arr = (value_t*)mem_realloc(&cpu->alloc, readptr_nullable(tab->arr), new_arr_cnt * sizeof(value_t));
+	tab->arr = writeptr(arr);
+	for (int i = tab->arr_cnt; i < new_arr_cnt; i++)
+		arr[i] = value_hole();
+	tab->arr_cnt = new_arr_cnt;
+	/* take over the keys now in range */
+	struct tabent* entries = (struct tabent*)readptr_nullable(tab->entry);
+	for (int p = 0; tab->hidx_cnt && p < tab->entry_top; p++) {
+		struct strobj* key = (struct strobj*)readptr_nullable(entries[p].key);
+		value_t* slot = key ? tab_arr_slot(cpu, tab, key) : NULL;
+		if (slot) {
+			*slot = entries[p].value;
+			if (*slot != value_hole())
+				tab->arr_used++;
+			tab_unlink(cpu, tab, key);
+			tab->hidx_cnt--;
 		}
-		prev = p;
-		p = ent->next;
 	}
-	return TAB_NULL;
+	return 1;
+}
+
+/* Value of key outside the array part, NULL if it is absent. out_p gets the
+ * slot or entry index for the inline cache */
+static value_t* tab_lookup(struct cpu* cpu, struct tabobj* tab, struct strobj* key, int* out_p) {
+	struct shapeobj* shape = (struct shapeobj*)readptr_nullable(tab->shape);
+	int p;
+	if (shape) {
+		p = shape_find(cpu, shape, key);
+		if (p < 0)
+			return NULL;
+		*out_p = p;
+		return &((value_t*)readptr(tab->slot))[p];
+	}
+	int pos = tab_find(cpu, tab, key);
+	if (pos < 0)
+		return NULL;
+	p = ((struct tabgroup*)readptr(tab->group))[pos / TAB_GROUP].slot[pos % TAB_GROUP];
+	*out_p = p;
+	return &((struct tabent*)readptr(tab->entry))[p].value;
 }
 
 value_t tab_get(struct cpu* cpu, struct tabobj* tab, struct strobj* key) {
-	uint16_t p = tab_find(cpu, tab, key, NULL);
-	if (p == TAB_NULL)
+	value_t* slot = tab_arr_slot(cpu, tab, key);
+	if (slot)
+		return value_unhole(*slot);
+	int p;
+	slot = tab_lookup(cpu, tab, key, &p);
+	if (!slot)
 		return value_undef();
-	return ((struct tabent*)readptr(tab->entry))[p].value;
+	return value_unhole(*slot);
 }
 
 int tab_in(struct cpu* cpu, struct tabobj* tab, struct strobj* key) {
-	return tab_find(cpu, tab, key, NULL) != TAB_NULL;
+	value_t* slot = tab_arr_slot(cpu, tab, key);
+	if (!slot) {
+		int p;
+		slot = tab_lookup(cpu, tab, key, &p);
+	}
+	return slot && *slot != value_hole();
 }
 
-void tab_set(struct cpu* cpu, struct tabobj* tab, struct strobj* key, value_t value) {
-	gc_barrier_kv(cpu, tab, key, value);
-	uint16_t p = tab_find(cpu, tab, key, NULL);
-	if (p != TAB_NULL) {
-		((struct tabent*)readptr(tab->entry))[p].value = value;
-		return;
-	}
-	if (tab->freelist == TAB_NULL)
+static uint32_t tab_insert(struct cpu* cpu, struct tabobj* tab, struct strobj* key, value_t value) {
+	if (tab->entry_top == tab->entry_cnt)
 		tab_grow(cpu, tab);
-	uint16_t bucket = key->hash % tab->bucket_cnt;
-	p = tab->freelist;
+	if (tab->growth_left == 0)
+		tab_rehash(cpu, tab);
+	uint32_t p = tab->entry_top++;
 	struct tabent* ent = &((struct tabent*)readptr(tab->entry))[p];
-	tab->freelist = ent->next;
 	ent->key = writeptr(key);
 	ent->value = value;
-	uint16_t* buckets = readptr(tab->bucket);
-	ent->next = buckets[bucket];
-	buckets[bucket] = p;
+	tab->entry_used++;
+	struct tabgroup* groups = (struct tabgroup*)readptr(tab->group);
+	int pos = tab_find_free(tab, groups, key->hash);
+	struct tabgroup* grp = &groups[pos / TAB_GROUP];
+	if (grp->ctrl[pos % TAB_GROUP] == CTRL_EMPTY)
+		tab->growth_left--;
+	grp->ctrl[pos % TAB_GROUP] = ctrl_h2(key->hash);
+	grp->slot[pos % TAB_GROUP] = p;
+	return p;
+}
+
+void tab_to_dict(struct cpu* cpu, struct tabobj* tab) {
+	struct shapeobj* shape = (struct shapeobj*)readptr_nullable(tab->shape);
+	if (!shape)
+		return;
+	value_t* slot = (value_t*)readptr_nullable(tab->slot);
+	/* The shape marked the keys already */
+	for (int i = 0; i < shape->key_cnt; i++)
+		tab_insert(cpu, tab, (struct strobj*)readptr(shape->keys[i]), slot[i]);
+	mem_dealloc(&cpu->alloc, slot);
+	tab->shape = writeptr_nullable(NULL);
+	tab->slot = writeptr_nullable(NULL);
+	tab->slot_cap = 0;
+}
+
+/* Set key outside the array part, returns the index for the inline cache */
+static int tab_put(struct cpu* cpu, struct tabobj* tab, struct strobj* key, value_t value, int index) {
+	int p;
+	value_t* slot = tab_lookup(cpu, tab, key, &p);
+	if (slot) {
+		gc_barrier(cpu, tab, value);
+		*slot = value;
+		return p;
+	}
+	struct shapeobj* shape = (struct shapeobj*)readptr_nullable(tab->shape);
+	if (shape) {
+		/* Number keys are not worth a shape */
+		struct shapeobj* next = index < 0 ? shape_add(cpu, shape, key) : NULL;
+		if (next) {
+			p = shape->key_cnt;
+			if (p == tab->slot_cap) {
+				tab->slot_cap = p == 0 ? 4 : p * 2;
+				tab->slot = writeptr(mem_realloc(&cpu->alloc, readptr_nullable(tab->slot), tab->slot_cap * sizeof(value_t)));
+			}
+			gc_barrier_shape(cpu, tab, next);
+			gc_barrier(cpu, tab, value);
+			tab->shape = writeptr(next);
+			((value_t*)readptr(tab->slot))[p] = value;
+			return p;
+		}
+		tab_to_dict(cpu, tab);
+	}
+	gc_barrier_kv(cpu, tab, key, value);
+	p = tab_insert(cpu, tab, key, value);
+	if (index >= 0)
+		tab->hidx_cnt++;
+	return p;
+}
+
+void tab_set(struct cpu* cpu, struct tabobj* tab, struct strobj* key, value_t value) {
+	int index = str_index(key);
+	if (index >= 0 && tab_set_index(cpu, tab, index, value))
+		return;
+	tab_put(cpu, tab, key, value, index);
+}
+
+value_t tab_get_miss(struct cpu* cpu, struct tabobj* tab, struct strobj* key, uint16_t* cache) {
+	value_t* slot = tab_arr_slot(cpu, tab, key);
+	if (slot)
+		return value_unhole(*slot);
+	int p;
+	slot = tab_lookup(cpu, tab, key, &p);
+	if (!slot)
+		return value_undef();
+	/* entries past the cache range always miss, the key check catches it */
+	*cache = (uint16_t)p;
+	return value_unhole(*slot);
+}
+
+void tab_set_miss(struct cpu* cpu, struct tabobj* tab, struct strobj* key, value_t value, uint16_t* cache) {
+	int index = str_index(key);
+	if (index >= 0 && tab_set_index(cpu, tab, index, value))
+		return;
+	*cache = (uint16_t)tab_put(cpu, tab, key, value, index);
+}
+
+int tab_reserve(struct cpu* cpu, struct tabobj* tab, struct strobj* key) {
+	/* entries only move when keys were deleted, which globals never are,
+	 * so the index can be used as a fixed slot */
+	tab_to_dict(cpu, tab);
+	int p;
+	if (tab_lookup(cpu, tab, key, &p))
+		return p;
+	/* slots are 16 bit immediates */
+	if (tab->entry_top >= UINT16_MAX)
+		return -1;
+	gc_barrier_kv(cpu, tab, key, value_hole());
+	return tab_insert(cpu, tab, key, value_hole());
+}
+
+int tab_delete_index(struct cpu* cpu, struct tabobj* tab, int index) {
+	value_t* arr = (value_t*)readptr(tab->arr);
+	if (arr[index] == value_hole())
+		return 0;
+	arr[index] = value_hole();
+	tab->arr_used--;
+	if (tab->arr_used == 0) {
+		mem_dealloc(&cpu->alloc, arr);
+		tab->arr_cnt = 0;
+		tab->arr = writeptr_nullable(NULL);
+		return 1;
+	}
+	/* Cut off the top half while it is empty, keys below stay put so nothing
+	 * has to move to the hash part */
+	int arr_cnt = tab->arr_cnt;
+	while (arr_cnt > TAB_ARR_MIN && tab->arr_used * 4 < arr_cnt && index >= arr_cnt / 2) {
+		int i = arr_cnt - 1;
+		while (i >= arr_cnt / 2 && arr[i] == value_hole())
+			i--;
+		if (i >= arr_cnt / 2)
+			break;
+		arr_cnt /= 2;
+	}
+	if (arr_cnt != tab->arr_cnt) {
+		tab->arr = writeptr(mem_realloc(&cpu->alloc, arr, arr_cnt * sizeof(value_t)));
+		tab->arr_cnt = arr_cnt;
+	}
+	return 1;
+}
+
+int tab_delete(struct cpu* cpu, struct tabobj* tab, struct strobj* key) {
+	int index = str_index(key);
+	if (index >= 0 && index < tab->arr_cnt)
+		return tab_delete_index(cpu, tab, index);
+	struct shapeobj* shape = (struct shapeobj*)readptr_nullable(tab->shape);
+	if (shape) {
+		int p = shape_find(cpu, shape, key);
+		if (p < 0)
+			return 0;
+		/* Undoing the last transition keeps the shape mode */
+		if (p == shape->key_cnt - 1) {
+			tab->shape = shape->parent;
+			return 1;
+		}
+		tab_to_dict(cpu, tab);
+	}
+	int p;
+	value_t* slot = tab_lookup(cpu, tab, key, &p);
+	if (!slot)
+		return 0;
+	/* Global slots are compiled into the code, the entry has to stay */
+	if (tab == readptr(cpu->globals)) {
+		int found = *slot != value_hole();
+		*slot = value_hole();
+		return found;
+	}
+	tab_unlink(cpu, tab, key);
+	if (index >= 0)
+		tab->hidx_cnt--;
+	/* Packing waits for the next insert, deleting the key at hand must not
+	 * move the entries under an iterator */
+	if (tab->entry_used == 0)
+		tab_free_hash(cpu, tab);
+	return 1;
+}
+
+/* Iteration walks the array part in index order, then the shape slots or
+ * entries in insertion order. Positions are checked against the current
+ * sizes on every step, so changing or deleting the current key is safe, and
+ * shape slots keep their position when the table turns into a dictionary.
+ * Keys in the array part come out as numbers, the iterator turns them into
+ * strings like the other keys */
+int tab_next(struct cpu* cpu, struct tabobj* tab, uint32_t* cursor, value_t* key, value_t* value) {
+	uint32_t i = *cursor;
+	if (!(i & TAB_ITER_HASH)) {
+		value_t* arr = (value_t*)readptr_nullable(tab->arr);
+		for (; i < (uint32_t)tab->arr_cnt; i++) {
+			if (arr[i] != value_hole()) {
+				*key = value_num(num_kuint((uint16_t)i));
+				*value = arr[i];
+				*cursor = i + 1;
+				return 1;
+			}
+		}
+		i = TAB_ITER_HASH;
+	}
+	int p = i & ~TAB_ITER_HASH;
+	struct shapeobj* shape = (struct shapeobj*)readptr_nullable(tab->shape);
+	if (shape) {
+		value_t* slot = (value_t*)readptr_nullable(tab->slot);
+		for (; p < shape->key_cnt; p++) {
+			if (slot[p] != value_hole()) {
+				*key = value_str((struct strobj*)readptr(shape->keys[p]));
+				*value = slot[p];
+				*cursor = TAB_ITER_HASH | (p + 1);
+				return 1;
+			}
+		}
+	}
+	else {
+		struct tabent* entries = (struct tabent*)readptr_nullable(tab->entry);
+		for (; p < tab->entry_top; p++) {
+			if (entries[p].key && entries[p].value != value_hole()) {
+				*key = value_str((struct strobj*)readptr(entries[p].key));
+				*value = entries[p].value;
+				*cursor = TAB_ITER_HASH | (p + 1);
+				return 1;
+			}
+		}
+	}
+	*cursor = TAB_ITER_HASH | p;
+	return 0;
 }
@@ -2,11 +2,78 @@
 #define _TAB_H
 
 #include "cpu.h"
+#include "gc.h"
+#include "shape.h"
+
+/* Whole numbers from 0 up are array part indices, see tab.c */
+#define num_is_index(num)	(((num) & (0x80000000 | ((1 << INT_SHIFT_BITS) - (1 << FRAC_SHIFT_BITS)))) == 0)
+#define num_index(num)		((int)((num) >> INT_SHIFT_BITS))
+/* Iteration cursor past the array part, see tab_next */
+#define TAB_ITER_HASH		(1 << 22)
 
 struct tabobj* tab_new(struct cpu* cpu);
 void tab_destroy(struct cpu* cpu, struct tabobj* tab);
 value_t tab_get(struct cpu* cpu, struct tabobj* tab, struct strobj* key);
 int tab_in(struct cpu* cpu, struct tabobj* tab, struct strobj* key);
 void tab_set(struct cpu* cpu, struct tabobj* tab, struct strobj* key, value_t value);
+int tab_reserve(struct cpu* cpu, struct tabobj* tab, struct strobj* key);
+void tab_to_dict(struct cpu* cpu, struct tabobj* tab);
+int tab_delete(struct cpu* cpu, struct tabobj* tab, struct strobj* key);
+int tab_delete_index(struct cpu* cpu, struct tabobj* tab, int index);
+value_t tab_get_miss(struct cpu* cpu, struct tabobj* tab, struct strobj* key, uint16_t* cache);
+void tab_set_miss(struct cpu* cpu, struct tabobj* tab, struct strobj* key, value_t value, uint16_t* cache);
+int tab_grow_arr(struct cpu* cpu, struct tabobj* tab, int index);
+int tab_next(struct cpu* cpu, struct tabobj* tab, uint32_t* cursor, value_t* key, value_t* value);
+
+/* Returns 0 if the array part does not cover index and should not grow */
+static FORCEINLINE int tab_set_index(struct cpu* cpu, struct tabobj* tab, int index, value_t value) {
+	if (unlikely(index >= tab->arr_cnt) && !tab_grow_arr(cpu, tab, index))
+		return 0;
+	value_t* slot = &((value_t*)readptr(tab->arr))[index];
+	gc_barrier(cpu, tab, value);
+	if (*slot == value_hole())
+		tab->arr_used++;
+	*slot = value;
+	return 1;
+}
+
+/* Inline cached access, cache holds the slot or entry index of the last
+ * lookup. A key match at that index is enough to validate, even after the
+ * entries were packed, which makes a shape check one compare. */
+static FORCEINLINE value_t tab_get_cached(struct cpu* cpu, struct tabobj* tab, struct strobj* key, uint16_t* cache) {
+	uint16_t p = *cache;
+	struct shapeobj* shape = (struct shapeobj*)readptr_nullable(tab->shape);
+	if (likely(shape)) {
+		if (likely(p < shape->key_cnt && shape->keys[p] == writeptr(key)))
+			return ((value_t*)readptr(tab->slot))[p];
+	}
+	else if (likely(p < tab->entry_cnt)) {
+		struct tabent* ent = &((struct tabent*)readptr(tab->entry))[p];
+		if (likely(ent->key == writeptr(key)))
+			return value_unhole(ent->value);
+	}
+	return tab_get_miss(cpu, tab, key, cache);
+}
+
+static FORCEINLINE void tab_set_cached(struct cpu* cpu, struct tabobj* tab, struct strobj* key, value_t value, uint16_t* cache) {
+	uint16_t p = *cache;
+	struct shapeobj* shape = (struct shapeobj*)readptr_nullable(tab->shape);
+	value_t* slot = NULL;
+	if (likely(shape)) {
+		if (likely(p < shape->key_cnt && shape->keys[p] == writeptr(key)))
+			slot = &((value_t*)readptr(tab->slot))[p];
+	}
+	else if (likely(p < tab->entry_cnt)) {
+		struct tabent* ent = &((struct tabent*)readptr(tab->entry))[p];
+		if (likely(ent->key == writeptr(key)))
+			slot = &ent->value;
+	}
+	if (likely(slot != NULL)) {
+		gc_barrier(cpu, tab, value);
+		*slot = value;
+		return;
+	}
+	tab_set_miss(cpu, tab, key, value, cache);
+}
 
 #endif
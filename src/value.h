@@ -82,6 +82,7 @@ typedef void* ptr_t;
  * 10tttttt | 00000000 : Undefined and null
  * 10tttttt | b 0....0 : Boolean
  * 10tttttt | ss | p.p : Call info: 8-bit stack size, 16-bit pc
+ * 10tttttt | i......i : Iteration cursor: 24-bit index
  * 11tttttt | o......o : 24-bit object offset pointer
  */
 typedef uint32_t value_t;
@@ -94,14 +95,15 @@ enum type {
 	t_cfunc = 13,
 	t_callinfo = 17,
 	t_str = 19,
-	t_striter = 23,
+	t_cursor = 21,
+	t_strbuf = 23,
 	t_buf = 27,
 	t_arr = 31,
-	t_arriter = 35,
 	t_tab = 39,
 	t_func = 43,
 	t_upval = 47,
 	t_assetmap = 51,
+	t_shape = 55,
 };
 
 #define value_is_num(val)			(((val) & 1) == 0)
@@ -113,6 +115,7 @@ enum type {
 #define value_get_cfunc(val)		((val) >> 8)
 #define value_get_ci_stacksize(val)	(((val) >> 8) & 0xFF)
 #define value_get_ci_pc(val)		((val) >> 16)
+#define value_get_cursor(val)		((val) >> 8)
 
 #define value_type_payload(t, p)	((value_t)((t) + ((p) << 8)))
 #define value_type_object(t, o)		(value_type_payload((t), forcewriteptr(o)))
@@ -122,14 +125,17 @@ enum type {
 #define value_bool(b)				(value_type_payload(t_bool, b))
 #define value_cfunc(cfunc)			(value_type_payload(t_cfunc, cfunc))
 #define value_callinfo(ss, pc)		(value_type_payload(t_callinfo, ((pc) << 8) + (ss)))
+#define value_cursor(i)				(value_type_payload(t_cursor, i))
 #define value_str(str)				(value_type_object(t_str, str))
-#define value_striter(striter)		(value_type_object(t_striter, striter))
+#define value_strbuf(sb)			(value_type_object(t_strbuf, sb))
 #define value_buf(buf)				(value_type_object(t_buf, buf))
 #define value_arr(arr)				(value_type_object(t_arr, arr))
-#define value_arriter(arriter)		(value_type_object(t_arriter, arriter))
 #define value_tab(tab)				(value_type_object(t_tab, tab))
 #define value_func(func)			(value_type_object(t_func, func))
 #define value_assetmap(map)			(value_type_object(t_assetmap, map))
+/* Table entry reserved for a key without value, reads as undefined */
+#define value_hole()				(value_type_payload(t_undef, 1))
+#define value_unhole(val)			((val) == value_hole() ? value_undef() : (val))
 
 struct obj {
 	OBJ_HEADER;
@@ -147,11 +153,11 @@ struct strobj {
 	char data[];
 };
 
-struct striterobj {
+/* Uninterned growable string, interned only when converted to a string */
+struct strbufobj {
 	OBJ_HEADER;
-	ptr(struct strobj) str;
-	uint32_t i;
-	uint32_t end;
+	uint32_t len, cap;
+	ptr_nullable(char) data;
 };
 
 struct bufobj {
@@ -166,28 +172,53 @@ struct arrobj {
 	ptr_nullable(value_t) data;
 };
 
-struct arriterobj {
-	OBJ_HEADER;
-	ptr(struct arrobj) arr;
-	uint32_t i;
-	uint32_t end;
-};
-
-#define TAB_NULL		((uint16_t)-1)
+#define TAB_GROUP		8
 
+/* Entries are appended in insertion order, deleted ones keep no key until
+ * the table packs them out */
 struct tabent {
 	ptr(struct strobj) key;
 	value_t value;
-	uint16_t next;
+};
+
+/* Open addressing index, see tab.c */
+struct tabgroup {
+	uint8_t ctrl[TAB_GROUP];
+	uint32_t slot[TAB_GROUP];
+};
+
+/* Key layout shared by tables, see shape.c */
+struct shapeobj {
+	OBJ_HEADER;
+	ptr_nullable(struct shapeobj) parent;
+	/* shapes with one more key (weak) */
+	ptr_nullable(struct shapeobj) child;
+	ptr_nullable(struct shapeobj) sibling;
+	uint16_t child_cnt;
+	uint16_t key_cnt;
+	ptr(struct strobj) keys[];
 };
 
 struct tabobj {
 	CONTAINER_OBJ_HEADER;
+	/* shape mode keeps the values in slot in the order of the shape keys,
+	 * dictionary mode has no shape and uses the hash part */
+	ptr_nullable(struct shapeobj) shape;
+	ptr_nullable(value_t) slot;
+	int slot_cap;
+	/* hash part */
 	int entry_cnt;
+	int entry_top; /* entries handed out */
+	int entry_used; /* entries with a key */
 	ptr_nullable(struct tabent) entry;
-	uint16_t freelist;
-	int bucket_cnt;
-	ptr_nullable(uint16_t) bucket;
+	int group_cnt;
+	int growth_left; /* empty index slots that can be filled before a rehash */
+	ptr_nullable(struct tabgroup) group;
+	/* array part for whole number keys below arr_cnt, see tab.c */
+	int arr_cnt;
+	int arr_used; /* slots which are not holes */
+	int hidx_cnt; /* whole number keys in the hash part */
+	ptr_nullable(value_t) arr;
 };
 
 struct assetmapobj {